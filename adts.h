@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Builds the 7-byte ADTS header that prefixes every raw AAC access unit on
+// the wire. The configuration comes from the AudioSpecificConfig stored in
+// the MP4 esds box (codecpar extradata), same as libavformat's adts muxer.
+class AdtsFramer {
+    int object_type = 0;  // MPEG-4 audio object type, 1..4
+    int sr_index = 0;
+    int channel_config = 0;
+
+    class BitReader {
+        const uint8_t *data;
+        int size_bits;
+        int pos = 0;
+
+       public:
+        BitReader(const uint8_t *d, int size) : data(d), size_bits(size * 8) {}
+
+        unsigned read(int n) {
+            if (pos + n > size_bits) {
+                throw std::runtime_error("Truncated AudioSpecificConfig");
+            }
+            unsigned v = 0;
+            for (int i = 0; i < n; i++, pos++) {
+                v = (v << 1) | ((data[pos >> 3] >> (7 - (pos & 7))) & 1);
+            }
+            return v;
+        }
+    };
+
+    static int read_object_type(BitReader &br) {
+        int aot = br.read(5);
+        return aot == 31 ? 32 + br.read(6) : aot;
+    }
+
+    static int read_sr_index(BitReader &br) {
+        int idx = br.read(4);
+        if (idx == 15) {
+            return sr_index_of(br.read(24));
+        }
+        return idx;
+    }
+
+   public:
+    static const int HEADER_SIZE = 7;
+    static const int MAX_FRAME_SIZE = (1 << 13) - 1;
+
+    static int sr_index_of(int sample_rate) {
+        for (int i = 0; i < 13; i++) {
+            if (sample_rates()[i] == sample_rate) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static int sample_rate_of(int sr_index) {
+        return sr_index >= 0 && sr_index <= 12 ? sample_rates()[sr_index] : 0;
+    }
+
+    AdtsFramer() = default;
+
+    // Configuration given as "PROFILE:RATE:CHANNELS", e.g. "lc:44100:2".
+    // HE-AAC files carry their AAC-LC core in ADTS, so they match "lc" at
+    // half their output rate.
+    static AdtsFramer parse(const std::string &spec) {
+        AdtsFramer f;
+        size_t c1 = spec.find(':');
+        size_t c2 = spec.find(':', c1 == std::string::npos ? c1 : c1 + 1);
+        if (c2 == std::string::npos) {
+            throw std::runtime_error("Format must be PROFILE:RATE:CHANNELS");
+        }
+        std::string profile = spec.substr(0, c1);
+        for (int i = 0; i < 4; i++) {
+            if (profile == profile_names()[i]) {
+                f.object_type = i + 1;
+            }
+        }
+        f.sr_index = sr_index_of(std::stoi(spec.substr(c1 + 1, c2 - c1 - 1)));
+        f.channel_config = std::stoi(spec.substr(c2 + 1));
+        f.check();
+        return f;
+    }
+
+    // Readable form of a key(), e.g. "lc:44100:2"
+    static std::string describe(uint32_t key) {
+        int aot = key >> 16;
+        int sr = (key >> 8) & 0xFF;
+        if (aot < 1 || aot > 4 || sr > 12) {
+            return "none";
+        }
+        return std::string(profile_names()[aot - 1]) + ":" +
+               std::to_string(sample_rates()[sr]) + ":" +
+               std::to_string(key & 0xFF);
+    }
+
+    static const int *sample_rates() {
+        static const int rates[] = {96000, 88200, 64000, 48000, 44100,
+                                    32000, 24000, 22050, 16000, 12000,
+                                    11025, 8000,  7350};
+        return rates;
+    }
+
+    static const char *const *profile_names() {
+        static const char *const names[] = {"main", "lc", "ssr", "ltp"};
+        return names;
+    }
+
+    void check() const {
+        if (object_type < 1 || object_type > 4) {
+            throw std::runtime_error("AAC object type not allowed in ADTS");
+        }
+        if (sr_index < 0 || sr_index > 12) {
+            throw std::runtime_error("Sample rate not representable in ADTS");
+        }
+        if (channel_config < 1 || channel_config > 7) {
+            throw std::runtime_error("Channel layout not supported in ADTS");
+        }
+    }
+
+    explicit AdtsFramer(const AVCodecParameters *par) {
+        if (par->codec_id != AV_CODEC_ID_AAC) {
+            throw std::runtime_error("Not an AAC stream");
+        }
+        if (par->extradata && par->extradata_size >= 2) {
+            BitReader br(par->extradata, par->extradata_size);
+            object_type = read_object_type(br);
+            sr_index = read_sr_index(br);
+            channel_config = br.read(4);
+            // Explicit SBR/PS signalling: ADTS carries the core AAC-LC
+            // config at the core rate and decoders pick up SBR implicitly
+            if (object_type == 5 || object_type == 29) {
+                read_sr_index(br);  // extension (output) rate
+                object_type = read_object_type(br);
+            }
+        } else {
+            object_type = par->profile == FF_PROFILE_UNKNOWN
+                              ? 2
+                              : par->profile + 1;
+            sr_index = sr_index_of(par->sample_rate);
+            channel_config = par->ch_layout.nb_channels;
+        }
+        check();
+    }
+
+    // Fills `hdr` for an access unit of `payload_size` bytes. Returns false
+    // if the frame does not fit the 13-bit ADTS length field.
+    bool header(uint8_t *hdr, int payload_size) const {
+        int len = payload_size + HEADER_SIZE;
+        if (len > MAX_FRAME_SIZE) {
+            return false;
+        }
+        hdr[0] = 0xFF;
+        hdr[1] = 0xF1;  // MPEG-4, layer 0, no CRC
+        hdr[2] = ((object_type - 1) << 6) | (sr_index << 2) |
+                 (channel_config >> 2);
+        hdr[3] = ((channel_config & 3) << 6) | (len >> 11);
+        hdr[4] = (len >> 3) & 0xFF;
+        hdr[5] = ((len & 7) << 5) | 0x1F;  // buffer fullness 0x7FF (VBR)
+        hdr[6] = 0xFC;
+        return true;
+    }
+
+    // Packs the configuration into one comparable value, 0 when unset
+    uint32_t key() const {
+        return object_type << 16 | sr_index << 8 | channel_config;
+    }
+
+    bool operator==(const AdtsFramer &o) const {
+        return object_type == o.object_type && sr_index == o.sr_index &&
+               channel_config == o.channel_config;
+    }
+    bool operator!=(const AdtsFramer &o) const { return !(*this == o); }
+};
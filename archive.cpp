@@ -0,0 +1,170 @@
+#include "archive.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "realtime.h"
+#include "sink.h"
+
+namespace {
+
+// A buffer holds about 16 s of a 128 kbit/s stream; together they ride
+// out a disk stalled for two minutes
+const size_t BUFFER_SIZE = 256 * 1024;
+const size_t BUFFER_COUNT = 8;
+const size_t BUFFER_ALIGN = 4096;
+// A partly filled buffer is written out after this long, bounding what a
+// crash loses
+const std::chrono::seconds FLUSH_INTERVAL(10);
+
+// Start of the local hour containing `t`
+time_t hour_start(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    return mktime(&tm);
+}
+
+}  // namespace
+
+Archive::Archive(const fs::path &d) : dir(d) {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec || access(dir.c_str(), W_OK) != 0) {
+        throw std::runtime_error("Could not write to archive directory " +
+                                 dir.string());
+    }
+    buffers.resize(BUFFER_COUNT);
+    for (Buffer &b : buffers) {
+        b.data = (uint8_t *)aligned_alloc(BUFFER_ALIGN, BUFFER_SIZE);
+        if (!b.data) {
+            for (Buffer &f : buffers) {
+                free(f.data);
+            }
+            throw std::runtime_error("Out of memory");
+        }
+        // Touch the pages now rather than in the pacing loop
+        memset(b.data, 0, BUFFER_SIZE);
+        free_buffers.push_back(&b);
+    }
+    thread = std::thread(&Archive::run, this);
+}
+
+Archive::~Archive() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current) {
+            full.push_back(current);
+        }
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+    for (Buffer &b : buffers) {
+        free(b.data);
+    }
+}
+
+void Archive::hand_over() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        full.push_back(current);
+    }
+    cv.notify_all();
+    current = nullptr;
+}
+
+void Archive::write(const uint8_t *hdr, int hdr_size, const uint8_t *data,
+                    int size) {
+    size_t frame = hdr_size + size;
+    time_t now = time(nullptr);
+    if (now >= next_hour) {
+        hour = hour_start(now);
+        next_hour = hour_start(hour + 3600 + 60);
+    }
+    if (current &&
+        (current->hour != hour || current->used + frame > BUFFER_SIZE ||
+         std::chrono::steady_clock::now() - current_since >=
+             FLUSH_INTERVAL)) {
+        hand_over();
+    }
+    if (!current) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_buffers.empty()) {
+            dropped += frame;
+            return;
+        }
+        current = free_buffers.front();
+        free_buffers.pop_front();
+        current->used = 0;
+        current->hour = hour;
+        current_since = std::chrono::steady_clock::now();
+    }
+    memcpy(current->data + current->used, hdr, hdr_size);
+    memcpy(current->data + current->used + hdr_size, data, size);
+    current->used += frame;
+}
+
+void Archive::run() {
+    make_thread_background();
+    int fd = -1;
+    time_t open_hour = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [&] { return stopping || !full.empty(); });
+        if (full.empty()) {
+            break;
+        }
+        Buffer *b = full.front();
+        full.pop_front();
+        uint64_t lost = dropped;
+        dropped = 0;
+        lock.unlock();
+
+        if (lost > 0) {
+            std::cerr << "Archive: disk too slow, " << lost
+                      << " bytes not recorded\n";
+        }
+        if (fd < 0 || b->hour != open_hour) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            struct tm tm;
+            localtime_r(&b->hour, &tm);
+            char name[32];
+            strftime(name, sizeof(name), "%Y-%m-%d-%H.aac", &tm);
+            fs::path path = dir / name;
+            // Appending, so a restart within the hour continues the file
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                      0644);
+            open_hour = b->hour;
+            if (fd < 0) {
+                std::cerr << "Archive: could not open " << path << ": "
+                          << strerror(errno) << "\n";
+            }
+        }
+        if (fd >= 0) {
+            off_t at = lseek(fd, 0, SEEK_END);
+            if (!write_all(fd, b->data, b->used, nullptr, 0)) {
+                std::cerr << "Archive: write failed: " << strerror(errno)
+                          << "\n";
+            } else if (fdatasync(fd) == 0) {
+                // The recording is never read back here; keep it from
+                // pushing the music out of the page cache
+                posix_fadvise(fd, at, b->used, POSIX_FADV_DONTNEED);
+            }
+        }
+
+        lock.lock();
+        free_buffers.push_back(b);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Air-check recording of the frames sent to the mount, one ADTS file per
+// hour of local time. The pacing thread only copies each frame into a
+// preallocated buffer; full buffers go to a writer thread at background
+// priority, so a slow or stalled disk never delays the stream. When every
+// buffer is waiting for the disk, frames are dropped whole and the gap is
+// logged.
+class Archive {
+    struct Buffer {
+        uint8_t *data;
+        size_t used = 0;
+        time_t hour = 0;  // start of the hour the data belongs to
+    };
+
+    fs::path dir;
+    std::vector<Buffer> buffers;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Buffer *> free_buffers;
+    std::deque<Buffer *> full;
+    uint64_t dropped = 0;  // bytes
+    bool stopping = false;
+    std::thread thread;
+
+    // Pacing thread state
+    Buffer *current = nullptr;
+    std::chrono::steady_clock::time_point current_since;
+    time_t hour = 0;
+    time_t next_hour = 0;
+
+    void hand_over();
+    void run();
+
+   public:
+    // Records into `dir`, creating it. Throws std::runtime_error.
+    explicit Archive(const fs::path &dir);
+    // Writes out what is buffered
+    ~Archive();
+
+    Archive(const Archive &) = delete;
+    Archive &operator=(const Archive &) = delete;
+
+    // Appends one frame, as sent. Never waits for the disk.
+    void write(const uint8_t *hdr, int hdr_size, const uint8_t *data,
+               int size);
+};
@@ -0,0 +1,255 @@
+#include "channel.h"
+
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+// Consecutive broken tracks before pausing between attempts
+const int FAILURE_BACKOFF = 5;
+const std::chrono::seconds FAILURE_PAUSE(1);
+// Wait before reconnecting a failed output, or looking at an empty
+// schedule again
+const std::chrono::seconds RETRY(5);
+// Poll interval while the first scan of the directory runs
+const std::chrono::milliseconds SCAN_WAIT(100);
+
+}  // namespace
+
+Channel::Channel(const std::string &l, const std::string &u,
+                 LibraryScanner &src, const ScheduleConfig &sc,
+                 const std::string &format)
+    : label(l),
+      url(u),
+      source(src),
+      scheduler(sc),
+      pkt(av_packet_alloc()) {
+    if (!pkt) {
+        throw std::runtime_error("Out of memory");
+    }
+    make_sink(sink, url);
+    if (!format.empty()) {
+        framer = AdtsFramer::parse(format);
+        framer_ready = true;
+        scheduler.set_mount(framer.key());
+    }
+}
+
+Channel::~Channel() {
+    close_track();
+    av_packet_free(&pkt);
+}
+
+void Channel::close_track() {
+    if (pending) {
+        av_packet_unref(pkt);
+        pending = false;
+    }
+    reader.reset();
+    input.reset();
+}
+
+void Channel::refresh_library() {
+    uint64_t version = source.version();
+    if (version == library_version) {
+        return;
+    }
+    library = source.latest();
+    library_version = version;
+    scheduler.rebuild(*library);
+    if (cycle_left == 0) {
+        cycle_left = library->size();
+    }
+}
+
+void Channel::attach(ThreadPool &pool, std::function<void()> w) {
+    io = &pool;
+    wake = std::move(w);
+}
+
+void Channel::connect() {
+    bool fresh = started;  // from scratch after a failure
+    started = true;
+    connecting = true;
+    io->submit([this, fresh] {
+        try {
+            if (fresh) {
+                make_sink(sink, url);
+            }
+            if (auto *ice = std::get_if<IcecastSink>(&sink)) {
+                // Titles go to the I/O threads too, and sends never wait
+                ThreadPool *pool = io;
+                ice->set_executor([pool](std::function<void()> job) {
+                    pool->submit(std::move(job));
+                });
+            }
+            std::visit([](auto &out) { out.open(); }, sink);
+            sink_ok = true;
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << label << ": " << e.what() << "\n";
+        }
+        wake();
+    });
+}
+
+void Channel::open_ahead() {
+    // A cycle's worth of tracks, as for a single stream; the scanner runs
+    // one rescan for all channels asking meanwhile
+    if (cycle_left == 0) {
+        source.request_rescan();
+        cycle_left = library->size();
+    }
+    cycle_left--;
+    next_path = library->path(scheduler.next()).string();
+    next_state = OPENING;
+    io->submit([this] {
+        try {
+            next_input = std::make_unique<InputFile>(next_path);
+        } catch (const std::exception &e) {
+            next_error = e.what();
+        }
+        if (next_state.exchange(READY) == WAITING) {
+            wake();
+        }
+    });
+}
+
+bool Channel::start_track() {
+    input = std::move(next_input);
+    std::string path = std::move(next_path);
+    std::string error = std::move(next_error);
+    next_state = IDLE;
+    try {
+        if (!input) {
+            throw std::runtime_error(error);
+        }
+        AVStream *st = input->stream();
+        AdtsFramer f(st->codecpar);
+        if (!framer_ready) {
+            framer = f;
+            framer_ready = true;
+            scheduler.set_mount(framer.key());
+        } else if (f != framer) {
+            throw std::runtime_error("Stream configuration differs from mount");
+        }
+        time_base = st->time_base;
+        reader = std::make_unique<TrackReader>(*input);
+        first_pts = AV_NOPTS_VALUE;
+        track_start_us = track_end_us = next_start_us;
+        std::visit([](auto &out) { out.start_track(); }, sink);
+        std::string title = track_title(input->ctx);
+        if (!title.empty()) {
+            std::visit([&](auto &out) { out.set_title(title); }, sink);
+        }
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << label << ": " << path << ": " << e.what()
+                  << "\n";
+        close_track();
+        failures++;
+        return false;
+    }
+}
+
+int64_t Channel::stream_us(const AVPacket *p) const {
+    return track_start_us +
+           av_rescale_q(p->pts - first_pts, time_base, AV_TIME_BASE_Q);
+}
+
+bool Channel::write(const AVPacket *p) {
+    uint8_t hdr[AdtsFramer::HEADER_SIZE];
+    if (!framer.header(hdr, p->size)) {
+        return true;  // skipped, like an oversized frame on the main mount
+    }
+    return std::visit(
+        [&](auto &out) {
+            return out.write_frame(hdr, sizeof(hdr), p->data, p->size);
+        },
+        sink);
+}
+
+Channel::Clock::time_point Channel::step(Clock::time_point now) {
+    if (connecting) {
+        // Woken by the connect job
+        connecting = false;
+        if (!sink_ok) {
+            retry_at = now + RETRY;
+            return retry_at;
+        }
+        // The timeline carries on from here with the next track
+        origin = now - std::chrono::microseconds(next_start_us);
+    }
+    if (!sink_ok) {
+        if (started && now < retry_at) {
+            return retry_at;
+        }
+        connect();
+        return PARKED;
+    }
+
+    while (true) {
+        if (!reader) {
+            refresh_library();
+            if (!library) {
+                return now + SCAN_WAIT;
+            }
+            if (scheduler.empty()) {
+                return now + RETRY;
+            }
+            if (failures >= FAILURE_BACKOFF && now < retry_at) {
+                return retry_at;
+            }
+            if (next_state == IDLE) {
+                open_ahead();
+            }
+            // Parks unless the job is done; either way exactly one side
+            // goes on, and a parked step touches nothing more
+            int opening = OPENING;
+            if (next_state.compare_exchange_strong(opening, WAITING)) {
+                return PARKED;
+            }
+            if (!start_track()) {
+                retry_at = now + FAILURE_PAUSE;
+                continue;
+            }
+            // The track after opens while this one plays
+            open_ahead();
+        }
+        if (!pending) {
+            pending = reader->next(pkt);
+            if (pending && first_pts == AV_NOPTS_VALUE) {
+                first_pts = pkt->pts;
+            }
+        }
+        if (!pending) {
+            if (first_pts == AV_NOPTS_VALUE) {
+                std::cerr << "Error: " << label << ": no audio in "
+                          << input->ctx->url << "\n";
+                failures++;
+                retry_at = now + FAILURE_PAUSE;
+            }
+            next_start_us = track_end_us;
+            close_track();
+            continue;
+        }
+
+        Clock::time_point due =
+            origin + std::chrono::microseconds(stream_us(pkt));
+        if (due > now) {
+            return due;
+        }
+        if (!write(pkt)) {
+            std::cerr << "Error: " << label << ": output lost\n";
+            sink_ok = false;
+            retry_at = now + RETRY;
+            next_start_us = track_end_us;
+            close_track();
+            return retry_at;
+        }
+        track_end_us = stream_us(pkt) +
+                       av_rescale_q(pkt->duration, time_base, AV_TIME_BASE_Q);
+        failures = 0;
+        av_packet_unref(pkt);
+        pending = false;
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "adts.h"
+#include "input_file.h"
+#include "library.h"
+#include "probe.h"
+#include "scheduler.h"
+#include "sink.h"
+#include "thread_pool.h"
+#include "track_reader.h"
+
+// One stream of the multi-channel mode: passthrough of a library's tracks
+// to an output through the same TrackReader as the main mount, but without
+// a thread or clock of its own. step() sends whatever is due and says when
+// the next packet is, so a ChannelScheduler runs any number of channels on
+// a few threads. Tracks follow each other on one continuous timeline.
+// Channels of the same directory share its scanner, and pick up each new
+// library between tracks.
+//
+// step() never blocks: connecting the output and opening files run on
+// separate I/O threads. The next track is opened while the current one
+// plays; a channel that has to wait for an open or a connect is parked
+// and woken when it is done.
+class Channel {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    // step()'s answer for a parked channel
+    static constexpr Clock::time_point PARKED = Clock::time_point::max();
+
+   private:
+    // Where opening the next track has got; WAITING is OPENING with the
+    // channel parked until it is READY
+    enum OpenState { IDLE, OPENING, WAITING, READY };
+
+    std::string label;  // for logs; the URL may hold a password
+    std::string url;
+    OutputSink sink;
+    bool sink_ok = false;
+    bool connecting = false;
+    Clock::time_point retry_at;
+
+    ThreadPool *io = nullptr;
+    std::function<void()> wake;
+
+    LibraryScanner &source;
+    uint64_t library_version = 0;
+    std::shared_ptr<const Library> library;
+    uint32_t cycle_left = 0;  // tracks before asking for a rescan
+    Scheduler scheduler;
+    AdtsFramer framer;
+    bool framer_ready = false;
+    int failures = 0;
+
+    bool started = false;
+    Clock::time_point origin;  // stream time 0
+    int64_t next_start_us = 0;  // where the next track goes on the timeline
+
+    // Written by the open job while OPENING, read by step() once READY
+    std::atomic<int> next_state{IDLE};
+    std::string next_path;
+    std::unique_ptr<InputFile> next_input;
+    std::string next_error;
+
+    std::unique_ptr<InputFile> input;
+    std::unique_ptr<TrackReader> reader;
+    AVRational time_base = {1, 1};
+    int64_t first_pts = AV_NOPTS_VALUE;  // of the track's first packet sent
+    int64_t track_start_us = 0;
+    int64_t track_end_us = 0;
+    AVPacket *pkt = nullptr;
+    bool pending = false;  // `pkt` read but not due yet
+
+    void refresh_library();
+    void connect();
+    void open_ahead();
+    bool start_track();
+    void close_track();
+    int64_t stream_us(const AVPacket *p) const;
+    bool write(const AVPacket *p);
+
+   public:
+    // Plays the libraries of `source` to the output `url` (see
+    // make_sink()). `format` is the mount configuration as for --format,
+    // empty to take the first track's.
+    Channel(const std::string &label, const std::string &url,
+            LibraryScanner &source, const ScheduleConfig &sc,
+            const std::string &format);
+    ~Channel();
+
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    const std::string &name() const { return label; }
+
+    // Runs blocking work on `io`, calling `wake` when a parked channel can
+    // go on. Both have to outlive the channel's last step(); once only,
+    // before the first.
+    void attach(ThreadPool &io, std::function<void()> wake);
+
+    // Sends the packets due by `now`, and returns when the next one is, or
+    // PARKED until `wake` is called.
+    Clock::time_point step(Clock::time_point now);
+};
@@ -0,0 +1,126 @@
+#include "channel_scheduler.h"
+
+namespace {
+
+// About one AAC frame
+const std::chrono::microseconds START_SPREAD(20000);
+// Threads for connects and file opens; they mostly wait on the network or
+// the disk, so a few serve many channels
+const size_t IO_THREADS = 16;
+
+}  // namespace
+
+ChannelScheduler::ChannelScheduler(size_t threads, const RealtimeConfig &rt)
+    : io(IO_THREADS, false), pool(threads, rt) {}
+
+void ChannelScheduler::add(std::unique_ptr<Channel> channel) {
+    // Channels started together would send in bursts at every frame for
+    // good; spreading their starts over a frame evens out the load
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t index = channels.size();
+    channel->attach(io, [this, index] { wake(index); });
+    timers.push({Clock::now() + START_SPREAD * (index % 1024) / 1024, index});
+    channels.push_back(std::move(channel));
+    due_at.emplace_back();
+}
+
+void ChannelScheduler::run_channel(size_t index) {
+    Clock::time_point now = Clock::now();
+    int64_t late_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                          now - due_at[index])
+                          .count();
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && (1LL << bucket) <= late_us) {
+        bucket++;
+    }
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    int64_t max = max_late_us.load(std::memory_order_relaxed);
+    while (late_us > max &&
+           !max_late_us.compare_exchange_weak(max, late_us,
+                                              std::memory_order_relaxed)) {
+    }
+
+    Clock::time_point next = channels[index]->step(now);
+    if (next == Channel::PARKED) {
+        return;  // back through wake()
+    }
+
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        earliest = timers.empty() || next < timers.top().due;
+        timers.push({next, index});
+    }
+    if (earliest) {
+        cv.notify_one();
+    }
+}
+
+void ChannelScheduler::wake(size_t index) {
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Clock::time_point now = Clock::now();
+        earliest = timers.empty() || now < timers.top().due;
+        timers.push({now, index});
+    }
+    if (earliest) {
+        cv.notify_one();
+    }
+}
+
+void ChannelScheduler::run(Clock::duration limit) {
+    Clock::time_point end = limit == Clock::duration::max()
+                                ? Clock::time_point::max()
+                                : Clock::now() + limit;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        Clock::time_point now = Clock::now();
+        if (now >= end) {
+            return;
+        }
+        if (timers.empty() || timers.top().due > now) {
+            Clock::time_point wake =
+                timers.empty() ? end : std::min(end, timers.top().due);
+            if (wake == Clock::time_point::max()) {
+                cv.wait(lock);
+            } else {
+                cv.wait_until(lock, wake);
+            }
+            continue;
+        }
+        while (!timers.empty() && timers.top().due <= now) {
+            size_t index = timers.top().channel;
+            due_at[index] = timers.top().due;
+            timers.pop();
+            pool.submit([this, index] { run_channel(index); });
+        }
+    }
+}
+
+ChannelScheduler::Lateness ChannelScheduler::lateness() const {
+    Lateness l;
+    uint64_t counts[BUCKETS];
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = histogram[i].load(std::memory_order_relaxed);
+        l.sends += counts[i];
+    }
+    // Upper bound of the bucket holding each percentile
+    auto percentile = [&](double p) {
+        uint64_t rank = l.sends * p;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen > rank) {
+                return i == 0 ? 0 : (int64_t)1 << i;
+            }
+        }
+        return (int64_t)1 << (BUCKETS - 1);
+    };
+    if (l.sends > 0) {
+        l.p50_us = percentile(0.5);
+        l.p99_us = percentile(0.99);
+    }
+    l.max_us = max_late_us.load(std::memory_order_relaxed);
+    return l;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+#include "channel.h"
+#include "realtime.h"
+#include "thread_pool.h"
+
+// Runs many channels on a fixed set of threads. Every channel waiting for
+// its next packet sits in one deadline heap; the calling thread sleeps
+// until the earliest deadline and hands the due channels to a
+// work-stealing pool, whose workers send their packets and put them back
+// with their next deadline. A channel is in the heap, on one worker, or
+// parked while its blocking work runs on separate I/O threads, never two of
+// these at once, so channels need no locking of their own.
+class ChannelScheduler {
+   public:
+    using Clock = Channel::Clock;
+
+    // How late sends started against their deadlines
+    struct Lateness {
+        uint64_t sends = 0;
+        int64_t p50_us = 0;
+        int64_t p99_us = 0;
+        int64_t max_us = 0;
+    };
+
+   private:
+    struct Timer {
+        Clock::time_point due;
+        size_t channel;
+        bool operator>(const Timer &o) const { return due > o.due; }
+    };
+
+    // Lateness histogram in power-of-two microsecond buckets
+    static const int BUCKETS = 32;
+
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::vector<Clock::time_point> due_at;  // of each dispatched channel
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>
+        timers;
+    std::atomic<uint64_t> histogram[BUCKETS] = {};
+    std::atomic<int64_t> max_late_us{0};
+
+    // Last, so workers are gone before anything they touch; I/O jobs may
+    // still wake channels while the send workers stop
+    ThreadPool io;
+    WorkStealingPool pool;
+
+    void run_channel(size_t index);
+    void wake(size_t index);
+
+   public:
+    // 0 threads: one per core
+    explicit ChannelScheduler(size_t threads = 0,
+                              const RealtimeConfig &rt = {});
+
+    ChannelScheduler(const ChannelScheduler &) = delete;
+    ChannelScheduler &operator=(const ChannelScheduler &) = delete;
+
+    size_t threads() const { return pool.size(); }
+    size_t size() const { return channels.size(); }
+
+    // Adds a channel, due right away; only before run()
+    void add(std::unique_ptr<Channel> channel);
+
+    // Dispatches due channels on the calling thread, for `limit` or for
+    // good
+    void run(Clock::duration limit = Clock::duration::max());
+
+    Lateness lateness() const;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "realtime.h"
+#include "scheduler.h"
+
+// A further mount streaming the variants found under `dir`
+struct RenditionConfig {
+    std::string dir;
+    std::string url;
+};
+
+// Command line settings
+struct Config {
+    std::string output_url;
+    std::string music_dir;
+    std::string cache_dir;  // empty: no persistent library index
+    std::string format;     // mount AAC configuration, empty: first track's
+    size_t transcode_threads = 0;  // 0: don't convert mismatched tracks
+    int transcode_budget = 100;    // percent of a converting thread's time
+    double normalize_lufs = 0;     // target loudness, 0: don't normalize
+    std::string control_path;      // control socket, empty: none
+    std::vector<RenditionConfig> renditions;
+    std::string archive_dir;       // air-check recording, empty: none
+    int64_t crossfade_us = 0;      // 0: hard cuts between tracks
+    bool analyze = false;          // measure loudness and exit
+    size_t analyze_threads = 0;    // 0: one per core
+    std::string channels_file;     // multi-channel mode, empty: one stream
+    size_t channel_threads = 0;    // 0: one per core
+    size_t bench_channels = 0;     // channel scaling benchmark, 0: none
+    RealtimeConfig realtime;
+    ScheduleConfig schedule;
+};
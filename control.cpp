@@ -0,0 +1,158 @@
+#include "control.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// Bounds on what clients can make the pacing thread do
+const size_t MAX_CLIENTS = 16;
+const size_t MAX_LINE = 4096;
+
+}  // namespace
+
+ControlSocket::ControlSocket(const std::string &p) : path(p) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Control socket path too long");
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // A socket left behind by an earlier run is replaced, anything else
+    // at that path is not
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path.c_str(), 0600) < 0 || listen(listen_fd, 4) < 0) {
+        std::string err = strerror(errno);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        throw std::runtime_error("Could not listen on " + path + ": " + err);
+    }
+    fds.reserve(MAX_CLIENTS + 1);
+    clients.reserve(MAX_CLIENTS);
+}
+
+ControlSocket::~ControlSocket() {
+    for (const Client &c : clients) {
+        close(c.fd);
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+}
+
+void ControlSocket::wait(std::chrono::nanoseconds timeout) {
+    fds.clear();
+    fds.push_back({listen_fd, POLLIN, 0});
+    for (const Client &c : clients) {
+        fds.push_back({c.fd, POLLIN, 0});
+    }
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    struct timespec ts = {(time_t)secs.count(),
+                          (long)(timeout - secs).count()};
+    if (ppoll(fds.data(), fds.size(), &ts, nullptr) <= 0) {
+        return;
+    }
+
+    // Clients first: accepting may reorder `clients`
+    for (size_t i = 1; i < fds.size(); i++) {
+        if (fds[i].revents == 0) {
+            continue;
+        }
+        auto it = std::find_if(clients.begin(), clients.end(),
+                               [&](const Client &c) {
+                                   return c.fd == fds[i].fd;
+                               });
+        if (it != clients.end() && !read_client(*it)) {
+            drop(it->fd);
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        accept_clients();
+    }
+}
+
+void ControlSocket::accept_clients() {
+    int fd;
+    while ((fd = accept4(listen_fd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (clients.size() >= MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        clients.push_back({fd, ""});
+    }
+}
+
+bool ControlSocket::read_client(Client &c) {
+    char buf[1024];
+    while (true) {
+        ssize_t n = read(c.fd, buf, sizeof(buf));
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        c.input.append(buf, n);
+        size_t nl;
+        while ((nl = c.input.find('\n')) != std::string::npos) {
+            std::string line = c.input.substr(0, nl);
+            c.input.erase(0, nl + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                commands.emplace_back(c.fd, std::move(line));
+            }
+        }
+        if (c.input.size() > MAX_LINE) {
+            return false;
+        }
+    }
+}
+
+void ControlSocket::drop(int fd) {
+    close(fd);
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [&](const Client &c) { return c.fd == fd; }),
+                  clients.end());
+    // Commands already read still run; their replies go nowhere
+}
+
+bool ControlSocket::next(int &client, std::string &line) {
+    if (commands.empty()) {
+        return false;
+    }
+    client = commands.front().first;
+    line = std::move(commands.front().second);
+    commands.pop_front();
+    return true;
+}
+
+void ControlSocket::reply(int client, const std::string &text) {
+    auto it = std::find_if(clients.begin(), clients.end(),
+                           [&](const Client &c) { return c.fd == client; });
+    if (it == clients.end()) {
+        return;
+    }
+    ssize_t n = send(client, text.data(), text.size(),
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n != (ssize_t)text.size()) {
+        drop(client);
+    }
+}
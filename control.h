@@ -0,0 +1,50 @@
+#pragma once
+
+#include <poll.h>
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Unix-domain control socket speaking a line protocol. It never blocks:
+// the pacing thread calls wait() in place of sleeping between packets, so
+// control traffic is read while the stream waits for its next deadline,
+// and commands are handled at the following packet boundary.
+class ControlSocket {
+    struct Client {
+        int fd;
+        std::string input;  // partial line
+    };
+
+    std::string path;
+    int listen_fd = -1;
+    std::vector<Client> clients;
+    std::vector<struct pollfd> fds;  // reused by wait()
+    std::deque<std::pair<int, std::string>> commands;
+
+    void accept_clients();
+    // Reads what `c` sent; false once the client is gone
+    bool read_client(Client &c);
+    void drop(int fd);
+
+   public:
+    // Listens on `path`, replacing a stale socket there. Throws
+    // std::runtime_error.
+    explicit ControlSocket(const std::string &path);
+    ~ControlSocket();
+
+    ControlSocket(const ControlSocket &) = delete;
+    ControlSocket &operator=(const ControlSocket &) = delete;
+
+    // Sleeps for up to `timeout`, returning early when a client connects
+    // or sends something. A zero timeout only polls.
+    void wait(std::chrono::nanoseconds timeout);
+
+    // Takes the oldest complete command line and the client it came from
+    bool next(int &client, std::string &line);
+
+    // Sends `text` to `client` without blocking; a client that doesn't
+    // keep up with its replies is dropped
+    void reply(int client, const std::string &text);
+};
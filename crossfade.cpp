@@ -0,0 +1,326 @@
+#include "crossfade.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include "mix.h"
+#include "probe.h"
+#include "realtime.h"
+#include "transcoder.h"
+
+namespace {
+
+using Pcm = std::vector<std::vector<float>>;  // one vector per channel
+
+// A track opened for decoding around one point
+struct Source {
+    AVFormatContext *ctx = nullptr;
+    AVStream *st = nullptr;
+    AVCodecContext *dec = nullptr;
+    SwrContext *swr = nullptr;
+    AVPacket *pkt = nullptr;
+    AVFrame *frame = nullptr;
+    AVFrame *conv = nullptr;
+    GaplessWindow window;
+    AVRational samples_tb = {1, 1};
+
+    ~Source() {
+        av_frame_free(&conv);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        swr_free(&swr);
+        avcodec_free_context(&dec);
+        avformat_close_input(&ctx);
+    }
+
+    // Opens `path` to decode into the encoder's sample format
+    void open(const std::string &path, const AVCodecContext *enc) {
+        if (avformat_open_input(&ctx, path.c_str(), nullptr, nullptr) < 0) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        const AVCodec *decoder = nullptr;
+        int idx = av_find_best_stream(ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                      &decoder, 0);
+        if (idx < 0 || !decoder) {
+            throw std::runtime_error("No decodable audio in " + path);
+        }
+        st = ctx->streams[idx];
+        dec = avcodec_alloc_context3(decoder);
+        if (!dec || avcodec_parameters_to_context(dec, st->codecpar) < 0) {
+            throw std::runtime_error("Out of memory");
+        }
+        dec->pkt_timebase = st->time_base;
+        if (avcodec_open2(dec, decoder, nullptr) < 0) {
+            throw std::runtime_error("Could not open decoder");
+        }
+        // SBR doubles the decoded rate; a plain AAC segment in an HE-AAC
+        // stream would switch the listener's output rate
+        if (dec->sample_rate != enc->sample_rate) {
+            throw std::runtime_error("Can't crossfade HE-AAC");
+        }
+        if (swr_alloc_set_opts2(&swr, &enc->ch_layout, enc->sample_fmt,
+                                enc->sample_rate, &dec->ch_layout,
+                                dec->sample_fmt, dec->sample_rate, 0,
+                                nullptr) < 0 ||
+            swr_init(swr) < 0) {
+            throw std::runtime_error("Could not set up resampler");
+        }
+        pkt = av_packet_alloc();
+        frame = av_frame_alloc();
+        conv = av_frame_alloc();
+        if (!pkt || !frame || !conv) {
+            throw std::runtime_error("Out of memory");
+        }
+        window = track_window(ctx, st);
+        if (window.end == INT64_MAX) {
+            throw std::runtime_error("No sample table in " + path);
+        }
+        samples_tb = {1, enc->sample_rate};
+    }
+
+    // Timestamp of the first packet at or after `ts`
+    int64_t packet_at(int64_t ts) {
+        int i = av_index_search_timestamp(st, ts, 0);
+        if (i < 0) {
+            throw std::runtime_error("Track too short to crossfade");
+        }
+        return avformat_index_get_entry(st, i)->timestamp;
+    }
+
+    // `count` samples from `from_ts` on, decoded and converted. Decoding
+    // starts two packets early so the first samples have their overlap.
+    Pcm decode(int64_t from_ts, int64_t count, int channels) {
+        Pcm out(channels, std::vector<float>(count));
+        int64_t from = av_rescale_q(from_ts, st->time_base, samples_tb);
+        int64_t seek_ts = from_ts - av_rescale_q(2 * 1024, samples_tb,
+                                                 st->time_base);
+        if (av_seek_frame(ctx, st->index, seek_ts, AVSEEK_FLAG_BACKWARD) <
+            0) {
+            throw std::runtime_error("Seek failed");
+        }
+        avcodec_flush_buffers(dec);
+
+        bool done = false;
+        while (!done && av_read_frame(ctx, pkt) >= 0) {
+            if (pkt->stream_index != st->index ||
+                avcodec_send_packet(dec, pkt) < 0) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            av_packet_unref(pkt);
+            while (avcodec_receive_frame(dec, frame) == 0) {
+                int64_t pos =
+                    av_rescale_q(frame->best_effort_timestamp,
+                                 st->time_base, samples_tb) -
+                    from;
+                av_frame_unref(conv);
+                conv->format = AV_SAMPLE_FMT_FLTP;
+                conv->sample_rate = samples_tb.den;
+                av_channel_layout_default(&conv->ch_layout, channels);
+                if (swr_convert_frame(swr, conv, frame) < 0) {
+                    throw std::runtime_error("Resampling failed");
+                }
+                av_frame_unref(frame);
+                for (int c = 0; c < channels; c++) {
+                    const float *src = (const float *)conv->data[c];
+                    for (int j = 0; j < conv->nb_samples; j++) {
+                        if (pos + j >= 0 && pos + j < count) {
+                            out[c][pos + j] = src[j];
+                        }
+                    }
+                }
+                done = pos + conv->nb_samples >= count;
+            }
+        }
+        return out;
+    }
+};
+
+struct EncoderDeleter {
+    void operator()(AVCodecContext *enc) const { avcodec_free_context(&enc); }
+};
+
+std::shared_ptr<FadeSegment> build_fade(const std::string &from,
+                                        const std::string &to,
+                                        int64_t fade_us, uint32_t key,
+                                        int64_t bit_rate) {
+    std::unique_ptr<AVCodecContext, EncoderDeleter> enc(
+        open_aac_encoder(key, false, bit_rate));
+    const int channels = enc->ch_layout.nb_channels;
+    const int64_t frame = enc->frame_size;
+    const AVRational samples_tb = {1, enc->sample_rate};
+
+    Source a, b;
+    a.open(from, enc.get());
+    b.open(to, enc.get());
+
+    auto seg = std::make_shared<FadeSegment>();
+    seg->from = from;
+    seg->to = to;
+    seg->time_base = samples_tb;
+
+    // The fade starts at the packet boundary about fade_us before the end
+    // of `from`'s real audio, and runs to that end
+    seg->cut_ts = a.packet_at(
+        a.window.end -
+        av_rescale_q(fade_us, AV_TIME_BASE_Q, a.st->time_base));
+    if (seg->cut_ts <= a.window.begin) {
+        throw std::runtime_error("Track too short to crossfade");
+    }
+    int64_t fade_len =
+        av_rescale_q(a.window.end - seg->cut_ts, a.st->time_base, samples_tb);
+    if (fade_len <= 0) {
+        throw std::runtime_error("Track too short to crossfade");
+    }
+    // Whole encoder frames; `to` carries on at the first packet after
+    // them, at most one frame later
+    int64_t seg_len = (fade_len + frame - 1) / frame * frame;
+    seg->resume_ts = b.packet_at(
+        b.window.begin +
+        av_rescale_q(seg_len, samples_tb, b.st->time_base));
+
+    // One frame of `from` ahead of the fade primes the encoder; its
+    // packets are dropped below
+    Pcm pa = a.decode(
+        seg->cut_ts - av_rescale_q(frame, samples_tb, a.st->time_base),
+        frame + fade_len, channels);
+    Pcm pb = b.decode(b.window.begin, seg_len, channels);
+
+    Pcm mixed(channels, std::vector<float>(frame + seg_len));
+    for (int c = 0; c < channels; c++) {
+        float *m = mixed[c].data();
+        std::copy_n(pa[c].begin(), frame, m);
+        mix_ramp(m + frame, pa[c].data() + frame, pb[c].data(), fade_len,
+                 0.0f, 1.0f / fade_len);
+        std::copy(pb[c].begin() + fade_len, pb[c].end(),
+                  m + frame + fade_len);
+    }
+
+    AVFrame *in = av_frame_alloc();
+    AVPacket *out = av_packet_alloc();
+    auto encoded = [&] {
+        while (avcodec_receive_packet(enc.get(), out) == 0) {
+            // Raw packet pts P decodes to input samples [P, P + frame)
+            if (out->pts >= frame && out->pts < frame + seg_len) {
+                out->pts -= frame;
+                out->dts = out->pts;
+                seg->packets.push_back(av_packet_clone(out));
+            }
+            av_packet_unref(out);
+        }
+    };
+    try {
+        if (!in || !out) {
+            throw std::runtime_error("Out of memory");
+        }
+        for (int64_t pos = 0; pos < frame + seg_len; pos += frame) {
+            av_frame_unref(in);
+            in->nb_samples = frame;
+            in->format = enc->sample_fmt;
+            in->sample_rate = enc->sample_rate;
+            av_channel_layout_copy(&in->ch_layout, &enc->ch_layout);
+            if (av_frame_get_buffer(in, 0) < 0) {
+                throw std::runtime_error("Out of memory");
+            }
+            for (int c = 0; c < channels; c++) {
+                std::copy_n(mixed[c].begin() + pos, frame,
+                            (float *)in->data[c]);
+            }
+            in->pts = pos;
+            if (avcodec_send_frame(enc.get(), in) < 0) {
+                throw std::runtime_error("Encoding failed");
+            }
+            encoded();
+        }
+        avcodec_send_frame(enc.get(), nullptr);
+        encoded();
+    } catch (...) {
+        av_frame_free(&in);
+        av_packet_free(&out);
+        throw;
+    }
+    av_frame_free(&in);
+    av_packet_free(&out);
+    return seg;
+}
+
+}  // namespace
+
+FadeSegment::~FadeSegment() {
+    for (AVPacket *p : packets) {
+        av_packet_free(&p);
+    }
+}
+
+Crossfader::Crossfader(int64_t fade)
+    : fade_us(fade), thread(&Crossfader::run, this) {}
+
+Crossfader::~Crossfader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void Crossfader::request(const std::string &from, const std::string &to) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (want_from == from && want_to == to) {
+            return;
+        }
+        want_from = from;
+        want_to = to;
+        ready.reset();
+    }
+    cv.notify_all();
+}
+
+std::shared_ptr<const FadeSegment> Crossfader::get(const std::string &from,
+                                                   const std::string &to) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ready && ready->from == from && ready->to == to) {
+        return ready;
+    }
+    return nullptr;
+}
+
+void Crossfader::run() {
+    make_thread_background();
+    std::unique_lock<std::mutex> lock(mutex);
+    std::string done_from, done_to;
+    while (true) {
+        cv.wait(lock, [&] {
+            return stopping || ((want_from != done_from ||
+                                 want_to != done_to) &&
+                                !want_from.empty() && target != 0);
+        });
+        if (stopping) {
+            return;
+        }
+        std::string from = done_from = want_from;
+        std::string to = done_to = want_to;
+        lock.unlock();
+
+        std::shared_ptr<FadeSegment> seg;
+        try {
+            seg = build_fade(from, to, fade_us, target, bitrate);
+        } catch (const std::exception &e) {
+            // That transition stays a hard cut
+            std::cerr << "Error: crossfade: " << e.what() << "\n";
+        }
+
+        lock.lock();
+        if (seg && want_from == from && want_to == to) {
+            ready = std::move(seg);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// An encoded transition from the end of one track into the start of the
+// next, spliced between their passthrough packets: the packets of `from`
+// from cut_ts on are replaced by `packets`, and `to` carries on from the
+// packet at resume_ts.
+struct FadeSegment {
+    std::string from;
+    std::string to;
+    int64_t cut_ts = 0;     // in the time base of `from`'s audio stream
+    int64_t resume_ts = 0;  // in the time base of `to`'s audio stream
+    AVRational time_base = {1, 1};  // of `packets`, which start at pts 0
+    std::vector<AVPacket *> packets;
+
+    FadeSegment() = default;
+    ~FadeSegment();
+    FadeSegment(const FadeSegment &) = delete;
+    FadeSegment &operator=(const FadeSegment &) = delete;
+};
+
+// Builds crossfades on a background thread while a track plays. Only the
+// last seconds of one track and the first seconds of the next are decoded,
+// mixed and re-encoded, so the cost follows the fade length, not the
+// track length. Crossfades are frame accurate: the splice points are
+// packet boundaries.
+class Crossfader {
+    int64_t fade_us;
+    std::atomic<uint32_t> target{0};
+    std::atomic<int64_t> bitrate{0};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string want_from;
+    std::string want_to;
+    std::shared_ptr<const FadeSegment> ready;
+    bool stopping = false;
+    std::thread thread;
+
+    void run();
+
+   public:
+    explicit Crossfader(int64_t fade_us);
+    ~Crossfader();
+
+    // Configuration to encode to, as AdtsFramer::key()
+    void set_target(uint32_t key) { target = key; }
+
+    // Bitrate of the mount; 0 until known picks one for the channel count
+    void set_bitrate(int64_t bit_rate) { bitrate = bit_rate; }
+
+    // Starts building the transition from `from` into `to`, dropping any
+    // earlier one
+    void request(const std::string &from, const std::string &to);
+
+    // The transition from `from` into `to` if it is ready, without waiting
+    std::shared_ptr<const FadeSegment> get(const std::string &from,
+                                           const std::string &to);
+};
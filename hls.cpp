@@ -0,0 +1,258 @@
+#include "hls.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+#include "adts.h"
+#include "realtime.h"
+#include "sink.h"
+
+namespace {
+
+const char *const PLAYLIST = "stream.m3u8";
+// AAC access unit, in samples
+const int FRAME_SAMPLES = 1024;
+
+void put_syncsafe(std::string &out, uint32_t v) {
+    out += (char)((v >> 21) & 0x7F);
+    out += (char)((v >> 14) & 0x7F);
+    out += (char)((v >> 7) & 0x7F);
+    out += (char)(v & 0x7F);
+}
+
+void put_frame(std::string &out, const char *id, const std::string &body) {
+    out.append(id, 4);
+    put_syncsafe(out, body.size());
+    out.append(2, '\0');  // flags
+    out += body;
+}
+
+// ID3v2.4 tag that starts every packed audio segment: the segment's
+// timestamp, which HLS requires, and the title if there is one
+std::string id3_tag(uint64_t timestamp, const std::string &title) {
+    std::string priv = "com.apple.streaming.transportStreamTimestamp";
+    priv += '\0';
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        priv += (char)((timestamp >> shift) & 0xFF);
+    }
+    std::string frames;
+    put_frame(frames, "PRIV", priv);
+    if (!title.empty()) {
+        put_frame(frames, "TIT2", "\x03" + title);  // UTF-8
+    }
+    std::string tag = "ID3";
+    tag += '\x04';
+    tag.append(2, '\0');  // revision, flags
+    put_syncsafe(tag, frames.size());
+    return tag + frames;
+}
+
+// Where a file is written before it is renamed into place
+fs::path temp_path(const fs::path &path) {
+    return path.parent_path() / ("." + path.filename().string());
+}
+
+bool write_string(int fd, const std::string &s) {
+    return write_all(fd, (const uint8_t *)s.data(), s.size(), nullptr, 0);
+}
+
+}  // namespace
+
+HlsSink::HlsSink(const std::string &spec) {
+    size_t q = spec.find('?');
+    dir = spec.substr(0, q);
+    if (dir.empty()) {
+        throw std::runtime_error("HLS output needs a directory");
+    }
+    if (q == std::string::npos) {
+        return;
+    }
+    std::istringstream params(spec.substr(q + 1));
+    std::string param;
+    while (std::getline(params, param, '&')) {
+        size_t eq = param.find('=');
+        std::string key = param.substr(0, eq);
+        std::string value =
+            eq == std::string::npos ? "" : param.substr(eq + 1);
+        if (key == "segment") {
+            segment_us = std::stod(value) * 1000000;
+        } else if (key == "window") {
+            window = std::stoul(value);
+        } else {
+            throw std::runtime_error("Unknown HLS parameter " + key);
+        }
+    }
+    if (segment_us < 1000000 || window < 3) {
+        throw std::runtime_error("HLS needs segments of 1 s and a window of "
+                                 "3 or more");
+    }
+}
+
+HlsSink::~HlsSink() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+fs::path HlsSink::segment_path(uint64_t seq) const {
+    return dir / ("segment-" + std::to_string(seq) + ".aac");
+}
+
+void HlsSink::open() {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec || access(dir.c_str(), W_OK) != 0) {
+        throw std::runtime_error("Could not write to HLS directory " +
+                                 dir.string());
+    }
+    // Numbered and timed from the wall clock, so a restarted stream moves
+    // on instead of reusing names and timestamps that caches still hold
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count();
+    sequence = now / 1000000;
+    base_timestamp = now * 9 / 100;
+    if (!thread.joinable()) {
+        thread = std::thread(&HlsSink::run, this);
+    }
+}
+
+void HlsSink::start_segment() {
+    uint64_t ts = base_timestamp + written * 90000 / sample_rate;
+    current += id3_tag(ts & ((1ULL << 33) - 1), title);
+}
+
+bool HlsSink::finish_segment() {
+    Segment s{sequence, (double)samples / sample_rate, std::move(current)};
+    written += samples;
+    samples = 0;
+    sequence++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // A disk this far behind would only hold more and more segments
+        if (failed || finished.size() >= window) {
+            return false;
+        }
+        finished.push_back(std::move(s));
+        current.clear();
+        if (!free_buffers.empty()) {
+            current = std::move(free_buffers.back());
+            free_buffers.pop_back();
+        }
+    }
+    cv.notify_one();
+    return true;
+}
+
+void HlsSink::run() {
+    make_thread_background();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || !finished.empty(); });
+        if (finished.empty()) {
+            return;  // stopping, with everything written
+        }
+        Segment s = std::move(finished.front());
+        finished.pop_front();
+        lock.unlock();
+        bool ok = write_segment(s);
+        s.data.clear();
+        lock.lock();
+        free_buffers.push_back(std::move(s.data));
+        if (!ok) {
+            failed = true;
+        }
+    }
+}
+
+bool HlsSink::write_segment(const Segment &s) {
+    fs::path path = segment_path(s.sequence);
+    int fd = ::open(temp_path(path).c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_string(fd, s.data);
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_path(path).c_str(), path.c_str()) != 0) {
+        unlink(temp_path(path).c_str());
+        return false;
+    }
+
+    listed.push_back({s.sequence, s.duration});
+    if (listed.size() > window) {
+        lingering.push_back(listed.front().sequence);
+        listed.pop_front();
+    }
+    if (!write_playlist()) {
+        return false;
+    }
+    // RFC 8216 6.2.2: a segment stays available for its own duration plus
+    // the playlist's after it was dropped, and none is longer than
+    // segment_us
+    if (lingering.size() > window + 1) {
+        unlink(segment_path(lingering.front()).c_str());
+        lingering.pop_front();
+    }
+    return true;
+}
+
+bool HlsSink::write_playlist() {
+    std::ostringstream os;
+    os << "#EXTM3U\n"
+       << "#EXT-X-VERSION:3\n"
+       << "#EXT-X-TARGETDURATION:" << (segment_us + 999999) / 1000000 << "\n"
+       << "#EXT-X-MEDIA-SEQUENCE:" << listed.front().sequence << "\n";
+    char extinf[32];
+    for (const Listed &s : listed) {
+        snprintf(extinf, sizeof(extinf), "#EXTINF:%.3f,\n", s.duration);
+        os << extinf << segment_path(s.sequence).filename().string() << "\n";
+    }
+
+    fs::path path = dir / PLAYLIST;
+    int pfd = ::open(temp_path(path).c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pfd < 0) {
+        return false;
+    }
+    bool ok = write_string(pfd, os.str());
+    ok = close(pfd) == 0 && ok;
+    return ok && rename(temp_path(path).c_str(), path.c_str()) == 0;
+}
+
+bool HlsSink::write_frame(const uint8_t *hdr, int hdr_size,
+                          const uint8_t *data, int size) {
+    if (sample_rate == 0) {
+        if (hdr_size < 3) {
+            return false;
+        }
+        sample_rate = AdtsFramer::sample_rate_of((hdr[2] >> 2) & 0x0F);
+        if (sample_rate == 0) {
+            return false;
+        }
+    }
+    if (!current.empty() && (int64_t)((samples + FRAME_SAMPLES) * 1000000 /
+                                      sample_rate) > segment_us) {
+        if (!finish_segment()) {
+            return false;
+        }
+    }
+    if (current.empty()) {
+        start_segment();
+    }
+    samples += FRAME_SAMPLES;
+    current.append((const char *)hdr, hdr_size);
+    current.append((const char *)data, size);
+    return true;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Writes the stream as a live HLS rendition for a web server or CDN to
+// serve: rolling packed-audio ADTS segments plus a playlist, in a local
+// directory. Frames are gathered into the segment in memory; a writer
+// thread at background priority puts finished segments and the playlist
+// on disk by rename(), so readers never see a partial file and the
+// sending thread never touches the disk. Segments are cut on frame
+// boundaries by sample count, which keeps them continuous across tracks.
+class HlsSink {
+    fs::path dir;
+    int64_t segment_us = 6 * 1000000;  // longest segment
+    size_t window = 6;                 // segments listed in the playlist
+
+    // Sending thread state
+    std::string current;  // segment being built, empty between segments
+    uint64_t sequence = 0;  // of that segment
+    int sample_rate = 0;
+    uint64_t samples = 0;         // in the current segment
+    uint64_t written = 0;         // in the finished ones
+    uint64_t base_timestamp = 0;  // 90 kHz time of the first segment
+    std::string title;
+
+    struct Segment {
+        uint64_t sequence;
+        double duration;  // seconds
+        std::string data;
+    };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Segment> finished;  // waiting for the writer
+    std::vector<std::string> free_buffers;  // written out, capacity kept
+    bool failed = false;
+    bool stopping = false;
+    std::thread thread;
+
+    // Writer thread state
+    struct Listed {
+        uint64_t sequence;
+        double duration;  // seconds
+    };
+    std::deque<Listed> listed;
+    // Dropped from the playlist but still around for clients that loaded
+    // an older one
+    std::deque<uint64_t> lingering;
+
+    fs::path segment_path(uint64_t seq) const;
+    void start_segment();
+    bool finish_segment();
+    bool write_segment(const Segment &s);
+    bool write_playlist();
+    void run();
+
+   public:
+    static constexpr bool paced = true;
+
+    // DIR[?segment=SEC&window=N]
+    explicit HlsSink(const std::string &spec);
+    // Writes out the finished segments
+    ~HlsSink();
+
+    HlsSink(const HlsSink &) = delete;
+    HlsSink &operator=(const HlsSink &) = delete;
+
+    // Creates the directory and starts the writer. Throws
+    // std::runtime_error.
+    void open();
+    // False once the writer failed or fell `window` segments behind
+    bool write_frame(const uint8_t *hdr, int hdr_size, const uint8_t *data,
+                     int size);
+    // Carried by the ID3 tag of the following segments
+    void set_title(const std::string &t) { title = t; }
+    void start_track() {}
+};
@@ -0,0 +1,708 @@
+#include "icecast_client.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "realtime.h"
+
+namespace {
+
+// Most a send() that can't wait keeps for a server that is behind; about
+// 4 s of a 128 kbit/s stream
+const size_t BACKLOG_MAX = 64 * 1024;
+
+// Standby sockets are recycled before Icecast's header-timeout (15s by
+// default) drops them
+const auto STANDBY_MAX_AGE = std::chrono::seconds(10);
+const auto RESOLVE_MAX_AGE = std::chrono::minutes(5);
+const int HANDSHAKE_TIMEOUT_MS = 3000;
+// How often send() looks at the live socket's unacknowledged bytes
+const auto QUEUE_CHECK_INTERVAL = std::chrono::milliseconds(100);
+
+std::string base64(const std::string &in) {
+    static const char tbl[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3) {
+        unsigned v = (uint8_t)in[i] << 16 | (uint8_t)in[i + 1] << 8 |
+                     (uint8_t)in[i + 2];
+        out += tbl[v >> 18];
+        out += tbl[(v >> 12) & 63];
+        out += tbl[(v >> 6) & 63];
+        out += tbl[v & 63];
+    }
+    if (i < in.size()) {
+        unsigned v = (uint8_t)in[i] << 16;
+        if (i + 1 < in.size()) {
+            v |= (uint8_t)in[i + 1] << 8;
+        }
+        out += tbl[v >> 18];
+        out += tbl[(v >> 12) & 63];
+        out += i + 1 < in.size() ? tbl[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+std::string url_encode(const std::string &s) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : s) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+            c == '/') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+    return out;
+}
+
+std::string url_decode(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size()) {
+            out += (char)std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+bool wait_fd(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = {fd, events, 0};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 && (pfd.revents & events) &&
+           !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+void close_fd(int &fd) {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+}  // namespace
+
+IcecastUrl IcecastUrl::parse(const std::string &str) {
+    const std::string scheme = "icecast://";
+    if (str.compare(0, scheme.size(), scheme) != 0) {
+        throw std::runtime_error("Not an icecast:// URL");
+    }
+    IcecastUrl u;
+    std::string rest = str.substr(scheme.size());
+
+    size_t q = rest.find('?');
+    if (q != std::string::npos) {
+        std::string query = rest.substr(q + 1);
+        rest.resize(q);
+        size_t pos = 0;
+        while (pos < query.size()) {
+            size_t amp = query.find('&', pos);
+            std::string kv = query.substr(pos, amp - pos);
+            pos = amp == std::string::npos ? query.size() : amp + 1;
+            size_t eq = kv.find('=');
+            if (eq == std::string::npos) {
+                continue;
+            }
+            std::string key = kv.substr(0, eq);
+            if (key == "name") {
+                u.name = url_decode(kv.substr(eq + 1));
+                continue;
+            }
+            if (key == "genre") {
+                u.genre = url_decode(kv.substr(eq + 1));
+                continue;
+            }
+            int val = std::stoi(kv.substr(eq + 1));
+            if (key == "sndbuf") {
+                u.sndbuf = val;
+            } else if (key == "lowat") {
+                u.notsent_lowat = val;
+            } else if (key == "connect_ms") {
+                u.connect_timeout_ms = val;
+            } else if (key == "stall_ms") {
+                u.stall_timeout_ms = val;
+            }
+        }
+    }
+
+    size_t slash = rest.find('/');
+    if (slash != std::string::npos) {
+        u.mount = rest.substr(slash);
+        rest.resize(slash);
+    }
+    size_t at = rest.rfind('@');
+    if (at != std::string::npos) {
+        std::string cred = rest.substr(0, at);
+        rest = rest.substr(at + 1);
+        size_t colon = cred.find(':');
+        if (colon == std::string::npos) {
+            u.user = url_decode(cred);
+        } else {
+            u.user = url_decode(cred.substr(0, colon));
+            u.password = url_decode(cred.substr(colon + 1));
+        }
+    }
+    if (!rest.empty() && rest[0] == '[') {  // [v6addr]:port
+        size_t close = rest.find(']');
+        u.host = rest.substr(1, close - 1);
+        rest = rest.substr(close + 1);
+        if (!rest.empty() && rest[0] == ':') {
+            u.port = rest.substr(1);
+        }
+    } else {
+        size_t colon = rest.rfind(':');
+        if (colon != std::string::npos) {
+            u.port = rest.substr(colon + 1);
+            rest.resize(colon);
+        }
+        u.host = rest;
+    }
+    if (u.host.empty()) {
+        throw std::runtime_error("Icecast URL has no host");
+    }
+    return u;
+}
+
+IcecastClient::IcecastClient(const std::string &str)
+    : url(IcecastUrl::parse(str)) {
+    std::string host = url.host.find(':') != std::string::npos
+                           ? "[" + url.host + "]:" + url.port
+                           : url.host + ":" + url.port;
+    host_header = "Host: " + host + "\r\n";
+    auth_header = "Authorization: Basic " +
+                  base64(url.user + ":" + url.password) + "\r\n";
+    std::string headers = host_header + auth_header +
+                          "User-Agent: icefeed\r\n"
+                          "Content-Type: audio/aac\r\n"
+                          "Ice-Name: " + url.name + "\r\n"
+                          "Ice-Genre: " + url.genre + "\r\n"
+                          "Ice-Public: 0\r\n"
+                          "\r\n";
+    request_put = "PUT " + url.mount + " HTTP/1.1\r\n" + headers;
+    request_source = "SOURCE " + url.mount + " HTTP/1.0\r\n" + headers;
+}
+
+IcecastClient::~IcecastClient() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (keeper.joinable()) {
+        keeper.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(title_mutex);
+        title_stopping = true;
+    }
+    title_cv.notify_all();
+    if (title_worker.joinable()) {
+        title_worker.join();
+    }
+    close_fd(standby_fd);
+    close_fd(live_fd);
+}
+
+void IcecastClient::resolve() {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = nullptr;
+    int err = getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &res);
+    if (err != 0) {
+        throw std::runtime_error("Could not resolve " + url.host + ": " +
+                                 gai_strerror(err));
+    }
+    std::vector<sockaddr_storage> found;
+    for (auto *ai = res; ai; ai = ai->ai_next) {
+        sockaddr_storage ss = {};
+        memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+        found.push_back(ss);
+    }
+    freeaddrinfo(res);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    addrs = std::move(found);
+    resolved_at = Clock::now();
+}
+
+// Opens a tuned, non-blocking TCP connection to the first reachable address
+int IcecastClient::connect_socket() {
+    std::vector<sockaddr_storage> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        candidates = addrs;
+    }
+
+    for (const auto &ss : candidates) {
+        socklen_t len = ss.ss_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                                 : sizeof(sockaddr_in);
+        int fd = socket(ss.ss_family,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (url.sndbuf > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &url.sndbuf,
+                       sizeof(url.sndbuf));
+        }
+#ifdef TCP_NOTSENT_LOWAT
+        if (url.notsent_lowat > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &url.notsent_lowat,
+                       sizeof(url.notsent_lowat));
+        }
+#endif
+
+        if (::connect(fd, (const sockaddr *)&ss, len) < 0 &&
+            errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (!wait_fd(fd, POLLOUT, url.connect_timeout_ms) ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 ||
+            err != 0) {
+            close(fd);
+            continue;
+        }
+        return fd;
+    }
+    return -1;
+}
+
+bool IcecastClient::handshake(int fd) {
+    const std::string &req = use_source_method ? request_source : request_put;
+    size_t sent = 0;
+    while (sent < req.size()) {
+        if (!wait_fd(fd, POLLOUT, HANDSHAKE_TIMEOUT_MS)) {
+            return false;
+        }
+        ssize_t n = ::send(fd, req.data() + sent, req.size() - sent,
+                           MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+        sent += n > 0 ? n : 0;
+    }
+
+    // Skip interim 1xx responses and wait for the final status
+    std::string resp;
+    char buf[512];
+    while (true) {
+        size_t end = resp.find("\r\n\r\n");
+        if (end != std::string::npos) {
+            int status = 0;
+            size_t sp = resp.find(' ');
+            if (sp != std::string::npos) {
+                status = atoi(resp.c_str() + sp + 1);
+            }
+            if (status >= 100 && status < 200) {
+                resp.erase(0, end + 4);
+                continue;
+            }
+            if (status == 200) {
+                return true;
+            }
+            std::cerr << "Icecast refused source: "
+                      << resp.substr(0, resp.find("\r\n")) << "\n";
+            // Icecast before 2.4 only understands SOURCE
+            if ((status == 400 || status == 405) && !use_source_method) {
+                use_source_method = true;
+            }
+            return false;
+        }
+        if (!wait_fd(fd, POLLIN, HANDSHAKE_TIMEOUT_MS)) {
+            return false;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        resp.append(buf, n);
+    }
+}
+
+int IcecastClient::take_standby() {
+    std::lock_guard<std::mutex> lock(mutex);
+    int fd = standby_fd;
+    standby_fd = -1;
+    cv.notify_all();
+    return fd;
+}
+
+bool IcecastClient::standby_ready() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return standby_fd >= 0;
+}
+
+bool IcecastClient::healthy_for(Clock::duration d) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return standby_fd >= 0 && reachable_since != Clock::time_point::max() &&
+           Clock::now() - reachable_since >= d;
+}
+
+void IcecastClient::keeper_loop() {
+    // May start after the pacing thread went realtime; don't inherit that
+    make_thread_background();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        auto now = Clock::now();
+        bool stale = standby_fd >= 0 && now - standby_since > STANDBY_MAX_AGE;
+        // A standby socket that turned readable was closed by the server
+        if (standby_fd >= 0 && !stale) {
+            struct pollfd pfd = {standby_fd, POLLIN | POLLRDHUP, 0};
+            stale = poll(&pfd, 1, 0) != 0;
+        }
+        if (stale) {
+            if (now - standby_since <= STANDBY_MAX_AGE) {
+                // Dropped by the server, which may be going down
+                reachable_since = Clock::time_point::max();
+            }
+            // Otherwise recycled for age, the server was fine all along
+            close_fd(standby_fd);
+        }
+
+        if (standby_fd < 0) {
+            bool need_resolve = now - resolved_at > RESOLVE_MAX_AGE;
+            lock.unlock();
+            if (need_resolve) {
+                try {
+                    resolve();
+                } catch (const std::exception &e) {
+                    // Keep using the addresses we already have
+                    std::cerr << "Error: " << e.what() << "\n";
+                }
+            }
+            int fd = connect_socket();
+            lock.lock();
+            if (stopping) {
+                close_fd(fd);
+                break;
+            }
+            standby_fd = fd;
+            standby_since = Clock::now();
+            if (fd < 0) {
+                reachable_since = Clock::time_point::max();
+            } else if (reachable_since == Clock::time_point::max()) {
+                reachable_since = standby_since;
+            }
+        }
+
+        cv.wait_for(lock, std::chrono::seconds(1));
+    }
+}
+
+void IcecastClient::warm() {
+    if (!executor && !keeper.joinable()) {
+        keeper = std::thread(&IcecastClient::keeper_loop, this);
+    }
+}
+
+void IcecastClient::connect() {
+    watched_fd = -1;
+    resolve();
+    live_fd = connect_socket();
+    if (live_fd < 0 || !handshake(live_fd)) {
+        close_fd(live_fd);
+        // The first attempt may have switched us to the SOURCE method
+        live_fd = connect_socket();
+        if (live_fd < 0 || !handshake(live_fd)) {
+            close_fd(live_fd);
+            throw std::runtime_error("Could not open Icecast connection");
+        }
+    }
+    warm();
+}
+
+void IcecastClient::disconnect() {
+    close_fd(live_fd);
+    watched_fd = -1;
+}
+
+void IcecastClient::mark_unreachable() {
+    std::lock_guard<std::mutex> lock(mutex);
+    reachable_since = Clock::time_point::max();
+}
+
+bool IcecastClient::reconnect(bool standby_only) {
+    disconnect();
+
+    int fd = take_standby();
+    if (fd >= 0 && handshake(fd)) {
+        live_fd = fd;
+        return true;
+    }
+    close_fd(fd);
+    mark_unreachable();
+    if (standby_only) {
+        return false;
+    }
+
+    fd = connect_socket();
+    if (fd >= 0 && handshake(fd)) {
+        live_fd = fd;
+        return true;
+    }
+    close_fd(fd);
+    return false;
+}
+
+bool IcecastClient::send(const uint8_t *hdr, int hdr_size,
+                         const uint8_t *data, int size) {
+    if (live_fd < 0) {
+        return false;
+    }
+    if (executor) {
+        return send_nowait(hdr, hdr_size, data, size);
+    }
+    int stall_ms =
+        url.stall_timeout_ms > 0 ? url.stall_timeout_ms : default_stall_ms;
+    struct iovec iov[2] = {{const_cast<uint8_t *>(hdr), (size_t)hdr_size},
+                           {const_cast<uint8_t *>(data), (size_t)size}};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(live_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN &&
+                wait_fd(live_fd, POLLOUT, stall_ms)) {
+                continue;
+            }
+            mark_unreachable();
+            return false;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    if (queue_stalled(Clock::now(), stall_ms)) {
+        mark_unreachable();
+        return false;
+    }
+    return true;
+}
+
+// A dead link, or a server whose receive window closed, shows in the
+// bytes it hasn't acknowledged: they grow at every check. That is seen
+// long before the send buffer fills up and a write blocks. On a healthy
+// connection they stay about one frame.
+bool IcecastClient::queue_stalled(Clock::time_point now, int stall_ms) {
+    if (now < next_queue_check) {
+        return false;
+    }
+    next_queue_check = now + QUEUE_CHECK_INTERVAL;
+    int queued = 0;
+    if (ioctl(live_fd, SIOCOUTQ, &queued) != 0) {
+        return false;
+    }
+    if (live_fd != watched_fd || queued <= last_queued) {
+        watched_fd = live_fd;
+        drained_at = now;
+    }
+    last_queued = queued;
+    return now - drained_at > std::chrono::milliseconds(stall_ms);
+}
+
+bool IcecastClient::send_nowait(const uint8_t *hdr, int hdr_size,
+                                const uint8_t *data, int size) {
+    auto now = Clock::now();
+    if (backlog_pos == backlog.size()) {
+        backlog.clear();
+        backlog_pos = 0;
+        last_progress = now;
+    }
+    if (backlog.empty()) {
+        struct iovec iov[2] = {{const_cast<uint8_t *>(hdr), (size_t)hdr_size},
+                               {const_cast<uint8_t *>(data), (size_t)size}};
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t n = sendmsg(live_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            mark_unreachable();
+            return false;
+        }
+        n = std::max<ssize_t>(n, 0);
+        if (n == hdr_size + size) {
+            return true;
+        }
+        // Keep the rest, in order
+        if (n < hdr_size) {
+            backlog.insert(backlog.end(), hdr + n, hdr + hdr_size);
+            n = hdr_size;
+        }
+        backlog.insert(backlog.end(), data + (n - hdr_size), data + size);
+    } else {
+        backlog.insert(backlog.end(), hdr, hdr + hdr_size);
+        backlog.insert(backlog.end(), data, data + size);
+        ssize_t n = ::send(live_fd, backlog.data() + backlog_pos,
+                           backlog.size() - backlog_pos,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            mark_unreachable();
+            return false;
+        }
+        if (n > 0) {
+            backlog_pos += n;
+            last_progress = now;
+        }
+        if (backlog_pos > BACKLOG_MAX) {
+            backlog.erase(backlog.begin(), backlog.begin() + backlog_pos);
+            backlog_pos = 0;
+        }
+    }
+
+    int stall_ms =
+        url.stall_timeout_ms > 0 ? url.stall_timeout_ms : default_stall_ms;
+    if (backlog.size() - backlog_pos > BACKLOG_MAX ||
+        now - last_progress > std::chrono::milliseconds(stall_ms) ||
+        queue_stalled(now, stall_ms)) {
+        mark_unreachable();
+        return false;
+    }
+    return true;
+}
+
+void IcecastClient::set_title(const std::string &song) {
+    bool start_job = false;
+    {
+        std::lock_guard<std::mutex> lock(title_mutex);
+        title = song;
+        title_pending = true;
+        if (executor) {
+            start_job = !title_job;
+            title_job = true;
+        } else if (!title_worker.joinable()) {
+            title_worker = std::thread(&IcecastClient::title_loop, this);
+        }
+    }
+    if (start_job) {
+        executor([self = shared_from_this()] { self->send_titles(); });
+    } else {
+        title_cv.notify_all();
+    }
+}
+
+// One job at a time sends whatever titles come in meanwhile, so they
+// arrive in order
+void IcecastClient::send_titles() {
+    std::unique_lock<std::mutex> lock(title_mutex);
+    while (title_pending) {
+        std::string song = std::move(title);
+        title_pending = false;
+        lock.unlock();
+        send_title(song);
+        lock.lock();
+    }
+    title_job = false;
+}
+
+void IcecastClient::title_loop() {
+    // Started by the first title, from the realtime pacing thread
+    make_thread_background();
+    std::unique_lock<std::mutex> lock(title_mutex);
+    while (true) {
+        title_cv.wait(lock,
+                      [this] { return title_stopping || title_pending; });
+        if (title_stopping) {
+            return;
+        }
+        std::string song = std::move(title);
+        title_pending = false;
+        lock.unlock();
+        send_title(song);
+        lock.lock();
+    }
+}
+
+// GET /admin/metadata on a connection of its own; the source connection
+// stays untouched
+bool IcecastClient::send_title(const std::string &song) {
+    std::string req = "GET /admin/metadata?mode=updinfo&charset=UTF-8&mount=" +
+                      url_encode(url.mount) + "&song=" + url_encode(song) +
+                      " HTTP/1.0\r\n" + host_header + auth_header +
+                      "User-Agent: icefeed\r\n\r\n";
+    int fd = connect_socket();
+    if (fd < 0) {
+        std::cerr << "Error: metadata update: could not connect\n";
+        return false;
+    }
+    size_t sent = 0;
+    std::string resp;
+    char buf[512];
+    while (sent < req.size()) {
+        if (!wait_fd(fd, POLLOUT, HANDSHAKE_TIMEOUT_MS)) {
+            break;
+        }
+        ssize_t n = ::send(fd, req.data() + sent, req.size() - sent,
+                           MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            break;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    while (sent == req.size() && resp.find("\r\n") == std::string::npos &&
+           wait_fd(fd, POLLIN, HANDSHAKE_TIMEOUT_MS)) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        resp.append(buf, n);
+    }
+    close(fd);
+
+    std::string status = resp.substr(0, resp.find("\r\n"));
+    size_t sp = status.find(' ');
+    if (sp == std::string::npos || atoi(status.c_str() + sp + 1) != 200) {
+        std::cerr << "Error: metadata update refused: "
+                  << (status.empty() ? "no response" : status) << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct IcecastUrl {
+    std::string host;
+    std::string port = "8000";
+    std::string user = "source";
+    std::string password;
+    std::string mount = "/";
+
+    // Socket tuning, taken from the URL query string
+    // (e.g. icecast://...:8000/live.aac?sndbuf=65536&stall_ms=1000)
+    int sndbuf = 64 * 1024;
+    int notsent_lowat = 16 * 1024;
+    int connect_timeout_ms = 2000;
+    int stall_timeout_ms = 0;  // 0: use the client's default
+    std::string name = "Icecast Stream";  // Ice-Name, ?name=My%20Radio
+    std::string genre = "Music";
+
+    static IcecastUrl parse(const std::string &url);
+};
+
+// HTTP PUT/SOURCE client for Icecast 2 that owns its sockets.
+//
+// Addresses are resolved up front and refreshed in the background, and a
+// keeper thread holds a connected standby socket with the request already
+// formatted. When the live connection fails, failover only costs the
+// request/response round trip on the standby socket.
+//
+// Song titles go to the server's admin metadata endpoint from a separate
+// worker thread, so those round trips never hold up a packet write.
+//
+// Many clients in one process can run without threads of their own
+// instead, see set_executor(). Clients are owned by shared_ptr, so a title
+// update still running elsewhere keeps its client alive.
+class IcecastClient : public std::enable_shared_from_this<IcecastClient> {
+    using Clock = std::chrono::steady_clock;
+
+   public:
+    using Executor = std::function<void(std::function<void()>)>;
+
+   private:
+
+    IcecastUrl url;
+    std::string host_header;
+    std::string auth_header;
+    std::string request_put;
+    std::string request_source;
+    bool use_source_method = false;
+
+    int live_fd = -1;
+    int default_stall_ms = 2000;
+    // Unacknowledged bytes on the live socket as send() last looked, and
+    // when they last stopped growing; -1 for a socket not looked at yet
+    int watched_fd = -1;
+    int last_queued = 0;
+    Clock::time_point drained_at;
+    Clock::time_point next_queue_check;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<sockaddr_storage> addrs;
+    Clock::time_point resolved_at;
+    int standby_fd = -1;
+    Clock::time_point standby_since;
+    // Since the keeper last failed to hold a standby, max() right after
+    Clock::time_point reachable_since = Clock::time_point::max();
+    bool stopping = false;
+    std::thread keeper;
+
+    std::mutex title_mutex;
+    std::condition_variable title_cv;
+    std::string title;
+    bool title_pending = false;
+    bool title_stopping = false;
+    std::thread title_worker;
+
+    // Without threads of the client's own: where title updates run, whether
+    // one is queued or running there, and the bytes send() couldn't write
+    // without waiting
+    Executor executor;
+    bool title_job = false;
+    std::vector<uint8_t> backlog;
+    size_t backlog_pos = 0;
+    Clock::time_point last_progress;
+
+    void resolve();
+    int connect_socket();
+    int take_standby();
+    bool handshake(int fd);
+    void keeper_loop();
+    void mark_unreachable();
+    bool queue_stalled(Clock::time_point now, int stall_ms);
+    void title_loop();
+    void send_titles();
+    bool send_title(const std::string &song);
+    bool send_nowait(const uint8_t *hdr, int hdr_size, const uint8_t *data,
+                     int size);
+
+   public:
+    explicit IcecastClient(const std::string &url);
+    ~IcecastClient();
+
+    IcecastClient(const IcecastClient &) = delete;
+    IcecastClient &operator=(const IcecastClient &) = delete;
+
+    const IcecastUrl &target() const { return url; }
+
+    // Stall timeout used when the URL does not set stall_ms
+    void set_default_stall_timeout(int ms) { default_stall_ms = ms; }
+
+    // For running many clients on shared threads; before connect(). Title
+    // updates run through `run` instead of a thread of the client's own, no
+    // standby connection is kept, and send() never waits: what the socket
+    // doesn't take is kept and written by later calls.
+    void set_executor(Executor run) { executor = std::move(run); }
+
+    // Starts keeping a standby connection warm without going live
+    void warm();
+
+    // Establishes the live connection and starts keeping a standby warm.
+    // Throws std::runtime_error if the server can not be reached.
+    void connect();
+
+    // Drops the live connection, leaving only the standby
+    void disconnect();
+
+    // Sends one frame on the live connection. Returns false if the write
+    // failed or stalled longer than stall_timeout_ms, or if the bytes the
+    // server hasn't acknowledged only grew for that long (with an executor
+    // also if it took nothing for that long, or fell too far behind); the
+    // caller then decides whether to fail over.
+    bool send(const uint8_t *hdr, int hdr_size, const uint8_t *data, int size);
+
+    // Replaces the live connection, preferring the warm standby socket;
+    // with `standby_only`, never waits for a fresh connect
+    bool reconnect(bool standby_only = false);
+
+    // True if a standby socket is connected and ready for a handshake
+    bool standby_ready();
+
+    // True if the keeper has held standby connections for `d` without a
+    // failed connect, one dropped by the server, or a failed live write or
+    // handshake
+    bool healthy_for(Clock::duration d);
+
+    // Queues a song title update for the mount and returns at once. Only
+    // the latest title is sent if updates pile up.
+    void set_title(const std::string &song);
+};
@@ -0,0 +1,21 @@
+#include "input_file.h"
+
+#include <stdexcept>
+
+InputFile::InputFile(const std::string &path) {
+    if (avformat_open_input(&ctx, path.c_str(), nullptr, nullptr) < 0) {
+        throw std::runtime_error("Could not open input file");
+    }
+    if (avformat_find_stream_info(ctx, nullptr) < 0) {
+        avformat_close_input(&ctx);
+        throw std::runtime_error("Failed to retrieve stream info");
+    }
+    stream_index =
+        av_find_best_stream(ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (stream_index < 0) {
+        avformat_close_input(&ctx);
+        throw std::runtime_error("No audio stream found");
+    }
+}
+
+InputFile::~InputFile() { avformat_close_input(&ctx); }
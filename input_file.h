@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// An opened input with its audio stream located. Closes itself.
+struct InputFile {
+    AVFormatContext *ctx = nullptr;
+    int stream_index = -1;
+
+    // Throws std::runtime_error if the file can't be opened or has no
+    // audio stream
+    explicit InputFile(const std::string &path);
+    ~InputFile();
+
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    AVStream *stream() const { return ctx->streams[stream_index]; }
+};
@@ -0,0 +1,647 @@
+#include "library.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#include "probe.h"
+#include "realtime.h"
+#include "thread_pool.h"
+
+namespace {
+
+const char INDEX_MAGIC[8] = {'I', 'C', 'E', 'F', 'I', 'D', 'X', 0};
+// Bumped whenever the record layout changes; older indexes are discarded
+const uint32_t INDEX_VERSION = 6;
+
+// Tracks measured per pool thread in one round of background analysis,
+// and how often the results are handed to the pacing thread meanwhile
+const size_t ANALYSIS_BATCH = 4;
+const std::chrono::minutes ANALYSIS_PUBLISH(10);
+
+// Names discover() looks at per file it returns; listing a directory
+// without stat costs little
+const size_t DISCOVER_SPAN = 32;
+
+// New files probed per pool thread between partial libraries
+const size_t PROBE_BATCH = 16;
+
+struct CachedTrack {
+    int64_t size;
+    int64_t mtime;
+    TrackProbe probe;
+};
+
+template <typename T>
+void put(std::ostream &os, const T &v) {
+    os.write(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+void put(std::ostream &os, const std::string &s) {
+    put<uint32_t>(os, s.size());
+    os.write(s.data(), s.size());
+}
+
+template <typename T>
+void get(std::istream &is, T &v) {
+    is.read(reinterpret_cast<char *>(&v), sizeof(v));
+}
+
+void get(std::istream &is, std::string &s) {
+    uint32_t len = 0;
+    get(is, len);
+    if (!is || len > (1 << 20)) {
+        is.setstate(std::ios::failbit);
+        return;
+    }
+    s.resize(len);
+    is.read(&s[0], len);
+}
+
+bool is_m4a(const fs::path &p) {
+    std::string ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".m4a" || ext == ".mp4";
+}
+
+}  // namespace
+
+uint32_t Library::find(const std::string &rel) const {
+    auto it = std::lower_bound(tracks.begin(), tracks.end(), rel,
+                               [&](const Track &t, const std::string &key) {
+                                   return names.compare(t.name, key.size() + 1,
+                                                        key.c_str(),
+                                                        key.size() + 1) < 0;
+                               });
+    if (it == tracks.end() || rel != names.data() + it->name) {
+        return NOT_FOUND;
+    }
+    return it - tracks.begin();
+}
+
+std::vector<std::string> discover(const fs::path &dir,
+                                  const std::vector<std::string> &rotation_dirs,
+                                  size_t limit) {
+    // A reservoir sample, so cold starts don't all open with the first
+    // files of the directory
+    std::mt19937_64 rng(std::random_device{}());
+    std::vector<std::string> found;
+    size_t seen = 0;
+    for (const auto &sub : rotation_dirs) {
+        std::error_code ec;
+        for (fs::directory_iterator it(dir / sub, ec), end;
+             !ec && it != end && seen < limit * DISCOVER_SPAN;
+             it.increment(ec)) {
+            if (!it->is_regular_file() || !is_m4a(it->path())) {
+                continue;
+            }
+            std::string rel = (fs::path(sub) / it->path().filename())
+                                  .lexically_normal()
+                                  .string();
+            seen++;
+            if (found.size() < limit) {
+                found.push_back(std::move(rel));
+            } else if (size_t slot = rng() % seen; slot < limit) {
+                found[slot] = std::move(rel);
+            }
+        }
+    }
+    std::shuffle(found.begin(), found.end(), rng);
+    return found;
+}
+
+void ProbeCache::merge(std::vector<std::pair<std::string, Entry>> entries) {
+    if (entries.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(writer);
+    auto next = std::make_shared<Map>(*snapshot());
+    for (auto &e : entries) {
+        (*next)[std::move(e.first)] = std::move(e.second);
+    }
+    std::atomic_store(&current, std::shared_ptr<const Map>(std::move(next)));
+}
+
+LibraryScanner::LibraryScanner(const fs::path &dir, const fs::path &index,
+                               const std::vector<std::string> &dirs,
+                               ThreadPool *shared_pool, ProbeCache *shared)
+    : root(dir),
+      index_file(index),
+      rotation_dirs(dirs),
+      own_pool(shared_pool ? nullptr : std::make_unique<ThreadPool>()),
+      pool(shared_pool ? shared_pool : own_pool.get()),
+      probes(shared) {}
+
+LibraryScanner::~LibraryScanner() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void LibraryScanner::start() {
+    requested = true;
+    thread = std::thread(&LibraryScanner::run, this);
+}
+
+void LibraryScanner::request_rescan() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requested = true;
+    }
+    cv.notify_all();
+}
+
+std::shared_ptr<const Library> LibraryScanner::take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::move(fresh);
+}
+
+void LibraryScanner::run() {
+    make_thread_background();
+    std::shared_ptr<Library> previous;
+    // Copy of `previous` the analysis writes into, published now and then
+    std::shared_ptr<Library> analysed;
+    auto published = std::chrono::steady_clock::now();
+    size_t measured = 0;
+    while (true) {
+        bool scan;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return requested || stopping || analysed; });
+            if (stopping) {
+                return;
+            }
+            scan = requested;
+            requested = false;
+        }
+
+        std::shared_ptr<Library> lib;
+        if (scan) {
+            lib = std::make_shared<Library>(root, index_file, rotation_dirs);
+            std::function<void(const Library &)> partial;
+            if (!previous) {
+                partial = [this](const Library &part) {
+                    publish(std::make_shared<Library>(part));
+                };
+            }
+            try {
+                lib->scan(analysed ? analysed.get() : previous.get(), pool,
+                          probes, partial);
+            } catch (const std::exception &e) {
+                std::cerr << "Error: library scan: " << e.what() << "\n";
+                continue;
+            }
+            if (measure) {
+                analysed = std::make_shared<Library>(*lib);
+            }
+        } else {
+            // One batch at a time, so a rescan or shutdown doesn't wait
+            // for the whole library
+            auto batch =
+                analysed->analyze(*pool, pool->size() * ANALYSIS_BATCH);
+            measured += batch.tracks;
+            bool done = batch.tracks == 0;
+            if (!done && std::chrono::steady_clock::now() - published <
+                             ANALYSIS_PUBLISH) {
+                continue;
+            }
+            if (measured > 0) {
+                std::cout << "Measured loudness of " << measured
+                          << " tracks\n";
+                analysed->save_index();
+                lib = std::make_shared<Library>(*analysed);
+            }
+            measured = 0;
+            if (done) {
+                analysed.reset();
+            }
+            if (!lib) {
+                continue;
+            }
+        }
+        previous = lib;
+        published = std::chrono::steady_clock::now();
+        publish(lib);
+    }
+}
+
+void LibraryScanner::publish(std::shared_ptr<const Library> lib) {
+    std::atomic_store(&newest, lib);
+    generation.fetch_add(1, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex);
+    fresh = std::move(lib);
+}
+
+LibraryRegistry::LibraryRegistry(const fs::path &dir,
+                                 const std::vector<std::string> &dirs)
+    : cache_dir(dir), rotation_dirs(dirs) {}
+
+LibraryScanner &LibraryRegistry::get(const fs::path &dir) {
+    std::string key = fs::weakly_canonical(dir).string();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &scanner = scanners[key];
+    if (!scanner) {
+        scanner = std::make_unique<LibraryScanner>(
+            key,
+            cache_dir.empty() ? fs::path()
+                              : cache_path(cache_dir, key, "index"),
+            rotation_dirs, &pool, &probes);
+        scanner->start();
+    }
+    return *scanner;
+}
+
+size_t LibraryRegistry::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return scanners.size();
+}
+
+fs::path cache_path(const fs::path &cache_dir, const fs::path &music_dir,
+                    const char *kind) {
+    // FNV-1a of the absolute music directory keeps caches apart
+    std::string key = fs::absolute(music_dir).lexically_normal().string();
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%016llx.bin", kind,
+             (unsigned long long)h);
+    return cache_dir / name;
+}
+
+Library::Library(const fs::path &dir, const fs::path &index,
+                 const std::vector<std::string> &dirs)
+    : root(dir), index_file(index), rotation_dirs(dirs) {
+    if (rotation_dirs.empty()) {
+        rotation_dirs.push_back(".");
+    }
+}
+
+void Library::load_index() {
+    index_loaded = true;
+    if (index_file.empty()) {
+        return;
+    }
+    std::ifstream is(index_file, std::ios::binary);
+    if (!is) {
+        return;
+    }
+    char magic[8];
+    uint32_t version = 0, count = 0;
+    is.read(magic, sizeof(magic));
+    get(is, version);
+    get(is, count);
+    if (!is || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        version != INDEX_VERSION) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < count && is; i++) {
+        std::string name, artist, album;
+        Track t;
+        TrackFile f;
+        get(is, name);
+        get(is, f.size);
+        get(is, f.mtime);
+        get(is, artist);
+        get(is, album);
+        get(is, t.status);
+        get(is, t.adts_key);
+        get(is, t.duration_us);
+        get(is, f.fingerprint);
+        get(is, f.loudness);
+        get(is, f.true_peak);
+        if (!is) {
+            break;
+        }
+        t.name = names.size();
+        t.artist = artists.intern(artist);
+        t.album = albums.intern(album);
+        t.rotation = 0;
+        names += name;
+        names += '\0';
+        tracks.push_back(t);
+        files.push_back(f);
+    }
+}
+
+void Library::save_index() const {
+    if (index_file.empty()) {
+        return;
+    }
+    std::error_code ec;
+    fs::create_directories(index_file.parent_path(), ec);
+    fs::path tmp = index_file;
+    tmp += ".tmp";
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        os.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        put(os, INDEX_VERSION);
+        put<uint32_t>(os, tracks.size());
+        for (uint32_t id = 0; id < tracks.size(); id++) {
+            const Track &t = tracks[id];
+            const TrackFile &f = files[id];
+            put(os, std::string(name(id)));
+            put(os, f.size);
+            put(os, f.mtime);
+            put(os, artists.str(t.artist));
+            put(os, albums.str(t.album));
+            put(os, t.status);
+            put(os, t.adts_key);
+            put(os, t.duration_us);
+            put(os, f.fingerprint);
+            put(os, f.loudness);
+            put(os, f.true_peak);
+        }
+        if (!os) {
+            std::cerr << "Error: could not write " << tmp << "\n";
+            return;
+        }
+    }
+    fs::rename(tmp, index_file, ec);
+}
+
+void Library::load_playlists() {
+    playlists.assign(rotation_dirs.size(), {});
+    for (size_t r = 0; r < rotation_dirs.size(); r++) {
+        if (!is_playlist(rotation_dirs[r])) {
+            continue;
+        }
+        // Entries resolve through the sorted track list, so a playlist
+        // costs a binary search per line and no file system access
+        size_t unknown = 0;
+        auto add = [&](const std::string &rel) {
+            uint32_t id = find(rel);
+            if (id == NOT_FOUND) {
+                unknown++;
+            } else {
+                playlists[r].push_back(id);
+            }
+        };
+        try {
+            size_t skipped = read_playlist(root / rotation_dirs[r], root, add);
+            unknown += skipped;
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+        }
+        playlists[r].shrink_to_fit();
+        if (unknown > 0) {
+            std::cerr << "Playlist " << rotation_dirs[r] << ": " << unknown
+                      << " entries not in the library\n";
+        }
+    }
+}
+
+Library::AnalysisStats Library::analyze(ThreadPool &pool, size_t limit) {
+    std::vector<uint32_t> ids;
+    for (uint32_t id = 0; id < tracks.size() && ids.size() < limit; id++) {
+        if (status(id) == TrackStatus::OK && !loudness(id).measured()) {
+            ids.push_back(id);
+        }
+    }
+
+    std::vector<Loudness> results(ids.size());
+    std::vector<uint8_t> failed(ids.size(), 0);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < ids.size(); i++) {
+        group.submit([this, &ids, &results, &failed, i] {
+            try {
+                results[i] = measure_loudness(path(ids[i]).string());
+            } catch (const std::exception &e) {
+                std::cerr << "Error: measuring " << name(ids[i]) << ": "
+                          << e.what() << "\n";
+                results[i] = {-HUGE_VALF, -HUGE_VALF};
+                failed[i] = 1;
+            }
+        });
+    }
+    group.wait();
+
+    AnalysisStats stats;
+    for (size_t i = 0; i < ids.size(); i++) {
+        TrackFile &f = files[ids[i]];
+        f.loudness = results[i].integrated;
+        f.true_peak = results[i].true_peak;
+        stats.tracks++;
+        stats.failed += failed[i];
+        stats.audio_us += tracks[ids[i]].duration_us;
+    }
+    return stats;
+}
+
+size_t Library::assign(const std::vector<Found> &found, bool known_only) {
+    std::string new_names;
+    StringPool new_artists;
+    StringPool new_albums;
+    std::vector<Track> new_tracks;
+    std::vector<TrackFile> new_files;
+    new_tracks.reserve(found.size());
+    new_files.reserve(found.size());
+    size_t quarantined = 0;
+    for (const Found &f : found) {
+        if (known_only && !f.known) {
+            continue;
+        }
+        if (new_names.size() > UINT32_MAX) {
+            throw std::runtime_error("Library too large");
+        }
+        if (f.probe.status != TrackStatus::OK) {
+            quarantined++;
+            if (f.needs_probe && !known_only) {
+                std::cerr << "Quarantined " << f.rel << ": "
+                          << track_status_name(f.probe.status) << "\n";
+            }
+        }
+        Track t;
+        t.name = new_names.size();
+        t.artist = new_artists.intern(f.probe.artist);
+        t.album = new_albums.intern(f.probe.album);
+        t.rotation = f.rotation;
+        t.status = static_cast<uint8_t>(f.probe.status);
+        t.adts_key = f.probe.adts_key;
+        t.duration_us = f.probe.duration_us;
+        new_names += f.rel;
+        new_names += '\0';
+        new_tracks.push_back(t);
+        new_files.push_back({f.size, f.mtime, f.probe.fingerprint,
+                             f.probe.loudness.integrated,
+                             f.probe.loudness.true_peak});
+    }
+
+    new_names.shrink_to_fit();
+    names = std::move(new_names);
+    artists = std::move(new_artists);
+    albums = std::move(new_albums);
+    tracks = std::move(new_tracks);
+    files = std::move(new_files);
+    return quarantined;
+}
+
+void Library::scan(const Library *previous, ThreadPool *pool,
+                   ProbeCache *shared,
+                   const std::function<void(const Library &)> &partial) {
+    if (!previous) {
+        if (!index_loaded) {
+            load_index();
+        }
+        previous = this;
+    }
+
+    // The previous track list doubles as the probe cache
+    std::unordered_map<std::string, CachedTrack> cache;
+    cache.reserve(previous->tracks.size());
+    for (uint32_t id = 0; id < previous->tracks.size(); id++) {
+        const Track &t = previous->tracks[id];
+        const TrackFile &f = previous->files[id];
+        TrackProbe probe;
+        probe.artist = previous->artists.str(t.artist);
+        probe.album = previous->albums.str(t.album);
+        probe.status = static_cast<TrackStatus>(t.status);
+        probe.adts_key = t.adts_key;
+        probe.duration_us = t.duration_us;
+        probe.fingerprint = f.fingerprint;
+        probe.loudness = {f.loudness, f.true_peak};
+        cache.emplace(previous->name(id),
+                      CachedTrack{f.size, f.mtime, std::move(probe)});
+    }
+    size_t cached = cache.size();
+    std::shared_ptr<const ProbeCache::Map> shared_probes;
+    if (shared) {
+        shared_probes = shared->snapshot();
+    }
+    const fs::path abs_root = fs::absolute(root).lexically_normal();
+
+    // Collect the files first, then probe the new and changed ones in
+    // parallel, each into its own slot
+    std::vector<Found> found;
+    for (size_t r = 0; r < rotation_dirs.size(); r++) {
+        if (is_playlist(rotation_dirs[r])) {
+            continue;
+        }
+        fs::path dir = root / rotation_dirs[r];
+        std::error_code ec;
+        for (const auto &entry : fs::directory_iterator(dir, ec)) {
+            if (!entry.is_regular_file() || !is_m4a(entry.path())) {
+                continue;
+            }
+            struct stat st;
+            if (stat(entry.path().c_str(), &st) < 0) {
+                continue;
+            }
+            Found f;
+            f.rel = (fs::path(rotation_dirs[r]) / entry.path().filename())
+                        .lexically_normal()
+                        .string();
+            f.rotation = r;
+            f.size = st.st_size;
+            f.mtime = st.st_mtime;
+            auto it = cache.find(f.rel);
+            f.needs_probe = it == cache.end() || it->second.size != f.size ||
+                            it->second.mtime != f.mtime;
+            if (!f.needs_probe) {
+                f.probe = std::move(it->second.probe);
+            } else if (shared_probes) {
+                // Probed for another library of the process already
+                auto s = shared_probes->find((abs_root / f.rel).string());
+                if (s != shared_probes->end() && s->second.size == f.size &&
+                    s->second.mtime == f.mtime) {
+                    f.probe = s->second.probe;
+                    f.needs_probe = false;
+                }
+            }
+            f.known = !f.needs_probe;
+            found.push_back(std::move(f));
+        }
+    }
+
+    if (found.size() > UINT32_MAX) {
+        throw std::runtime_error("Library too large");
+    }
+    // Ids follow name order, so the same files always get the same ids
+    std::sort(found.begin(), found.end(),
+              [](const Found &a, const Found &b) { return a.rel < b.rel; });
+
+    // A batch of probes at a time; meanwhile `partial` gets what is known,
+    // each time the playable part has doubled
+    std::vector<Found *> to_probe;
+    size_t playable = 0;
+    for (Found &f : found) {
+        if (f.needs_probe) {
+            to_probe.push_back(&f);
+        } else if (f.probe.status == TrackStatus::OK) {
+            playable++;
+        }
+    }
+    size_t batch = (pool ? pool->size() : 1) * PROBE_BATCH;
+    size_t published = 0;
+    for (size_t next = 0; next < to_probe.size();) {
+        if (partial && playable > 0 && playable >= 2 * published) {
+            Library part(root, fs::path(), rotation_dirs);
+            part.assign(found, true);
+            partial(part);
+            published = playable;
+        }
+        size_t end = std::min(next + batch, to_probe.size());
+        std::unique_ptr<TaskGroup> group;
+        if (pool) {
+            group = std::make_unique<TaskGroup>(*pool);
+        }
+        for (size_t i = next; i < end; i++) {
+            Found *f = to_probe[i];
+            auto job = [this, f] {
+                probe_track((root / f->rel).string(), f->probe);
+            };
+            if (group) {
+                group->submit(job);
+            } else {
+                job();
+            }
+        }
+        if (group) {
+            group->wait();
+        }
+        for (size_t i = next; i < end; i++) {
+            to_probe[i]->known = true;
+            playable += to_probe[i]->probe.status == TrackStatus::OK;
+        }
+        next = end;
+    }
+    size_t probed = to_probe.size();
+
+    // Share what the other libraries of the process don't know yet
+    if (shared) {
+        std::vector<std::pair<std::string, ProbeCache::Entry>> entries;
+        for (const Found &f : found) {
+            std::string abs = (abs_root / f.rel).string();
+            auto s = shared_probes->find(abs);
+            if (s == shared_probes->end() || s->second.size != f.size ||
+                s->second.mtime != f.mtime) {
+                entries.emplace_back(std::move(abs),
+                                     ProbeCache::Entry{f.size, f.mtime,
+                                                       f.probe});
+            }
+        }
+        shared->merge(std::move(entries));
+    }
+
+    size_t quarantined = assign(found, false);
+    load_playlists();
+
+    if (probed > 0 || tracks.size() != cached) {
+        std::cout << "Indexed " << tracks.size() << " tracks, " << probed
+                  << " probed, " << quarantined << " quarantined\n";
+        save_index();
+    }
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "playlist.h"
+#include "probe.h"
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+// Interned strings (artist and album names) with dense ids; id 0 is the
+// empty string
+class StringPool {
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<const std::string *> by_id;
+
+   public:
+    StringPool() { intern(""); }
+    StringPool(const StringPool &other) : StringPool() {
+        for (uint32_t id = 1; id < other.size(); id++) {
+            intern(other.str(id));
+        }
+    }
+    StringPool &operator=(const StringPool &other) {
+        StringPool copy(other);
+        return *this = std::move(copy);
+    }
+    StringPool(StringPool &&) = default;
+    StringPool &operator=(StringPool &&) = default;
+
+    uint32_t intern(const std::string &s) {
+        auto it = ids.emplace(s, by_id.size()).first;
+        if (it->second == by_id.size()) {
+            by_id.push_back(&it->first);
+        }
+        return it->second;
+    }
+
+    const std::string &str(uint32_t id) const { return *by_id[id]; }
+    uint32_t size() const { return by_id.size(); }
+};
+
+// Probe results shared by every library of the process, keyed by absolute
+// path, so directories that overlap probe each file once. Readers look
+// things up in an immutable snapshot taken with one atomic load; a scan
+// merges its results into a new snapshot when it is done.
+class ProbeCache {
+   public:
+    struct Entry {
+        int64_t size;
+        int64_t mtime;
+        TrackProbe probe;
+    };
+    using Map = std::unordered_map<std::string, Entry>;
+
+   private:
+    std::shared_ptr<const Map> current = std::make_shared<const Map>();
+    std::mutex writer;  // serializes merges; readers never take it
+
+   public:
+    std::shared_ptr<const Map> snapshot() const {
+        return std::atomic_load(&current);
+    }
+
+    // Publishes a snapshot with `entries` added or replaced
+    void merge(std::vector<std::pair<std::string, Entry>> entries);
+};
+
+// Track list of the music directory. Tracks are identified by a dense
+// 32-bit id in name order; file names live back to back in one string
+// arena, so a track costs its name plus two fixed-size records (32 bytes
+// read by the scheduler, 32 more for the index and duplicate checks) and
+// no per-track allocation.
+//
+// Files are probed and validated once and the results kept in an index
+// file, keyed by name, size and mtime, so a rescan only opens new or
+// changed files. Files that fail validation stay listed with their status
+// so they are not probed again, but are never scheduled.
+//
+// Loudness takes decoding the whole file, so it isn't measured by scan()
+// but by analyze(), a batch at a time; a rescan keeps the measurements of
+// unchanged files.
+class Library {
+    // What picking and playing a track reads
+    struct Track {
+        uint32_t name;  // offset into the name arena
+        uint32_t artist;
+        uint32_t album;
+        uint16_t rotation;  // index into rotation_dirs
+        uint8_t status;     // TrackStatus
+        uint32_t adts_key;  // AdtsFramer::key(), 0 if not AAC
+        int64_t duration_us;
+    };
+    // The rest, in a parallel array, so scheduling walks denser memory
+    struct TrackFile {
+        int64_t size;
+        int64_t mtime;
+        uint64_t fingerprint;  // TrackProbe::fingerprint
+        float loudness;        // Loudness::integrated
+        float true_peak;       // Loudness::true_peak
+    };
+    // A file as scan() lists it
+    struct Found {
+        std::string rel;
+        uint16_t rotation;
+        int64_t size;
+        int64_t mtime;
+        TrackProbe probe;
+        bool needs_probe;
+        bool known;  // `probe` is filled in
+    };
+
+    fs::path root;
+    fs::path index_file;
+    std::vector<std::string> rotation_dirs;
+
+    std::string names;
+    StringPool artists;
+    StringPool albums;
+    std::vector<Track> tracks;
+    std::vector<TrackFile> files;  // by track id
+    // Track ids per rotation, for the rotations that are playlists
+    std::vector<std::vector<uint32_t>> playlists;
+    bool index_loaded = false;
+
+    void load_playlists();
+
+    void load_index();
+
+    // Replaces the track list with `found`, sorted by name, or only its
+    // known files; returns how many are quarantined
+    size_t assign(const std::vector<Found> &found, bool known_only);
+
+   public:
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    // What one analyze() call measured
+    struct AnalysisStats {
+        size_t tracks = 0;
+        size_t failed = 0;
+        int64_t audio_us = 0;  // playing time of the measured tracks
+    };
+
+    // `rotation_dirs` lists the subdirectories that are scanned too, each
+    // one forming a rotation class; "." is the music directory itself.
+    // An entry may also name a playlist file (see is_playlist()), whose
+    // entries are looked up among the tracks of the directories.
+    // An empty `index_file` disables the persistent index.
+    Library(const fs::path &dir, const fs::path &index_file,
+            const std::vector<std::string> &rotation_dirs);
+
+    // Lists the .m4a/.mp4 files, replacing the track list. Probe results
+    // are reused from `previous` if given, otherwise from this object's
+    // own track list or the index file, and then from `shared`. New files
+    // are probed on `pool` when given, and added to `shared`. While they
+    // are, `partial` is given the files known so far, without playlists or
+    // index, whenever their playable count has doubled.
+    void scan(const Library *previous = nullptr, ThreadPool *pool = nullptr,
+              ProbeCache *shared = nullptr,
+              const std::function<void(const Library &)> &partial = nullptr);
+
+    // Measures the loudness of up to `limit` playable tracks that have
+    // none yet, in parallel on `pool`. A file that can't be decoded is
+    // recorded as silent so it isn't tried again.
+    AnalysisStats analyze(ThreadPool &pool, size_t limit = SIZE_MAX);
+
+    // Writes the index file, if there is one
+    void save_index() const;
+
+    uint32_t size() const { return tracks.size(); }
+    bool empty() const { return tracks.empty(); }
+
+    const char *name(uint32_t id) const {
+        return names.data() + tracks[id].name;
+    }
+    fs::path path(uint32_t id) const { return root / name(id); }
+
+    // Id of the track with relative name `rel`, or NOT_FOUND
+    uint32_t find(const std::string &rel) const;
+
+    // Artist/album ids index artist_pool()/album_pool(), 0 when untagged
+    uint32_t artist(uint32_t id) const { return tracks[id].artist; }
+    uint32_t album(uint32_t id) const { return tracks[id].album; }
+    const StringPool &artist_pool() const { return artists; }
+    const StringPool &album_pool() const { return albums; }
+
+    uint16_t rotation(uint32_t id) const { return tracks[id].rotation; }
+    int64_t file_size(uint32_t id) const { return files[id].size; }
+    int64_t mtime(uint32_t id) const { return files[id].mtime; }
+
+    // Playing time as streamed, without encoder delay and padding
+    int64_t duration_us(uint32_t id) const { return tracks[id].duration_us; }
+
+    TrackStatus status(uint32_t id) const {
+        return static_cast<TrackStatus>(tracks[id].status);
+    }
+    uint32_t adts_key(uint32_t id) const { return tracks[id].adts_key; }
+
+    // Equal for files with the same audio, 0 if unknown
+    uint64_t fingerprint(uint32_t id) const { return files[id].fingerprint; }
+
+    // Not measured() until analyze() got to the track
+    Loudness loudness(uint32_t id) const {
+        return {files[id].loudness, files[id].true_peak};
+    }
+    size_t rotation_count() const { return rotation_dirs.size(); }
+
+    // Tracks listed by rotation `r` if it is a playlist, in playlist order
+    // and with repeats; nullptr for a directory
+    const std::vector<uint32_t> *playlist(size_t r) const {
+        return r < playlists.size() && is_playlist(rotation_dirs[r])
+                   ? &playlists[r]
+                   : nullptr;
+    }
+};
+
+// Rescans the library on a background thread. Each scan produces a new
+// immutable Library; the pacing thread picks it up between tracks, so
+// neither the first scan nor later ones hold up playback. The first scan
+// also publishes the part probed so far as it goes, so a large library
+// without an index starts playing from it early. If loudness is
+// wanted, the thread measures that of new tracks between scans,
+// publishing the results as a new Library every ANALYSIS_PUBLISH interval
+// and once it is done.
+//
+// Any number of readers can follow the scanner besides take(). Checking
+// for a new library is one atomic load of version(); latest() is only
+// needed when it has moved on. Readers keep the library they hold as long
+// as they like, so publishing never waits for them.
+class LibraryScanner {
+    fs::path root;
+    fs::path index_file;
+    std::vector<std::string> rotation_dirs;
+    // Probes and analyses new files in parallel; its own, or one shared
+    // with other scanners, each waiting only for its own jobs
+    std::unique_ptr<ThreadPool> own_pool;
+    ThreadPool *pool;
+    ProbeCache *probes;
+    bool measure = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::shared_ptr<const Library> fresh;
+    std::shared_ptr<const Library> newest;  // atomic_load/atomic_store
+    std::atomic<uint64_t> generation{0};
+    bool requested = false;
+    bool stopping = false;
+    std::thread thread;
+
+    void publish(std::shared_ptr<const Library> lib);
+    void run();
+
+   public:
+    // Scans on `pool` if given, sharing probe results through `probes`
+    LibraryScanner(const fs::path &dir, const fs::path &index_file,
+                   const std::vector<std::string> &rotation_dirs,
+                   ThreadPool *pool = nullptr, ProbeCache *probes = nullptr);
+    ~LibraryScanner();
+
+    // Measures loudness between scans (see Library::analyze()); only
+    // before start()
+    void measure_loudness() { measure = true; }
+
+    // Starts the thread with a first scan
+    void start();
+    void request_rescan();
+
+    // The scan completed since the last call, or nullptr
+    std::shared_ptr<const Library> take();
+
+    // Number of libraries published so far
+    uint64_t version() const {
+        return generation.load(std::memory_order_acquire);
+    }
+
+    // The newest library, or nullptr before the first scan completes
+    std::shared_ptr<const Library> latest() const {
+        return std::atomic_load(&newest);
+    }
+};
+
+// The libraries of every channel in the process: one scanner per music
+// directory, however many channels play it, all of them sharing one probe
+// cache and one pool of probing threads. Adding a channel of a known
+// directory costs no scanning or probing at all. Channels don't normalize,
+// so their scanners don't measure loudness.
+class LibraryRegistry {
+    fs::path cache_dir;
+    std::vector<std::string> rotation_dirs;
+    ProbeCache probes;
+    ThreadPool pool;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<LibraryScanner>>
+        scanners;
+
+   public:
+    // Index files go to `cache_dir` as for a single stream; empty: none
+    LibraryRegistry(const fs::path &cache_dir,
+                    const std::vector<std::string> &rotation_dirs);
+
+    // The scanner of `dir`, started on first use
+    LibraryScanner &get(const fs::path &dir);
+
+    size_t size();
+};
+
+// Up to `limit` playable files in random order, sampled from the first
+// ones in directory order, without stat or probing; used to start playing
+// before the first scan is done
+std::vector<std::string> discover(const fs::path &dir,
+                                  const std::vector<std::string> &rotation_dirs,
+                                  size_t limit);
+
+// Location of a per-music-directory cache file ("index", "state", ...)
+// inside `cache_dir`
+fs::path cache_path(const fs::path &cache_dir, const fs::path &music_dir,
+                    const char *kind);
@@ -0,0 +1,511 @@
+#include "loudness.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// 4x oversampling interpolator of ITU-R BS.1770-4 Annex 2, one row per
+// phase
+const int TAPS = 12;
+const float INTERPOLATOR[4][TAPS] = {
+    {0.0017089843750f, 0.0109863281250f, -0.0196533203125f,
+     0.0332031250000f, -0.0594482421875f, 0.1373291015625f,
+     0.9721679687500f, -0.1022949218750f, 0.0476074218750f,
+     -0.0266113281250f, 0.0148925781250f, -0.0083007812500f},
+    {-0.0291748046875f, 0.0292968750000f, -0.0517578125000f,
+     0.0891113281250f, -0.1665039062500f, 0.4650878906250f,
+     0.7797851562500f, -0.2003173828125f, 0.1015625000000f,
+     -0.0582275390625f, 0.0330810546875f, -0.0189208984375f},
+    {-0.0189208984375f, 0.0330810546875f, -0.0582275390625f,
+     0.1015625000000f, -0.2003173828125f, 0.7797851562500f,
+     0.4650878906250f, -0.1665039062500f, 0.0891113281250f,
+     -0.0517578125000f, 0.0292968750000f, -0.0291748046875f},
+    {-0.0083007812500f, 0.0148925781250f, -0.0266113281250f,
+     0.0476074218750f, -0.1022949218750f, 0.9721679687500f,
+     0.1373291015625f, -0.0594482421875f, 0.0332031250000f,
+     -0.0196533203125f, 0.0109863281250f, 0.0017089843750f}};
+
+// Largest |y| of the oversampled signal over x[0..n); x[-TAPS+1..-1]
+// must hold the preceding samples
+float peak_4x_scalar(const float *x, size_t n) {
+    float peak = 0;
+    for (size_t i = 0; i < n; i++) {
+        const float *at = x + i;  // looking back from here
+        for (int p = 0; p < 4; p++) {
+            float y = 0;
+            for (int k = 0; k < TAPS; k++) {
+                y += INTERPOLATOR[p][k] * at[-k];
+            }
+            peak = std::max(peak, std::abs(y));
+        }
+    }
+    return peak;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2,fma"))) float peak_4x_avx2(const float *x,
+                                                        size_t n) {
+    // Eight input samples at a time, one phase after the other; each tap
+    // is a broadcast coefficient times an unaligned load
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 peak = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int p = 0; p < 4; p++) {
+            __m256 y = _mm256_setzero_ps();
+            for (int k = 0; k < TAPS; k++) {
+                y = _mm256_fmadd_ps(_mm256_set1_ps(INTERPOLATOR[p][k]),
+                                    _mm256_loadu_ps(x + i - k), y);
+            }
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, y));
+        }
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peak);
+    float result = peak_4x_scalar(x + i, n - i);
+    for (float v : lanes) {
+        result = std::max(result, v);
+    }
+    return result;
+}
+
+using PeakFn = float (*)(const float *, size_t);
+
+PeakFn pick_peak() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return peak_4x_avx2;
+    }
+    return peak_4x_scalar;
+}
+
+const PeakFn peak_impl = pick_peak();
+
+#elif defined(__ARM_NEON)
+
+float peak_4x_neon(const float *x, size_t n) {
+    float32x4_t peak = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int p = 0; p < 4; p++) {
+            float32x4_t y = vdupq_n_f32(0);
+            for (int k = 0; k < TAPS; k++) {
+                y = vmlaq_n_f32(y, vld1q_f32(x + i - k), INTERPOLATOR[p][k]);
+            }
+            peak = vmaxq_f32(peak, vabsq_f32(y));
+        }
+    }
+    float lanes[4];
+    vst1q_f32(lanes, peak);
+    float result = peak_4x_scalar(x + i, n - i);
+    for (float v : lanes) {
+        result = std::max(result, v);
+    }
+    return result;
+}
+
+const auto peak_impl = peak_4x_neon;
+
+#else
+
+const auto peak_impl = peak_4x_scalar;
+
+#endif
+
+// Direct form I biquad with a0 = 1
+struct Biquad {
+    double b0, b1, b2, a1, a2;
+    double x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+
+    double operator()(double x) {
+        double y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        return y;
+    }
+};
+
+// Both stages of one channel's K-weighting filter: high shelf, then high
+// pass
+struct KFilter {
+    Biquad shelf;
+    Biquad highpass;
+};
+
+// Coefficients derived for any sample rate from the analog prototypes of
+// BS.1770
+void k_weighting(int rate, KFilter &f) {
+    double f0 = 1681.974450955533;
+    double gain_db = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = std::tan(M_PI * f0 / rate);
+    double vh = std::pow(10.0, gain_db / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    f.shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    f.shelf.b1 = 2.0 * (k * k - vh) / a0;
+    f.shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    f.shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    f.shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = std::tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    f.highpass.b0 = 1.0;
+    f.highpass.b1 = -2.0;
+    f.highpass.b2 = 1.0;
+    f.highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    f.highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+// Adds `weight` times the K-weighted power of src[0..n) to energy[0..n)
+void k_weight_scalar(KFilter &f, const float *src, double weight, size_t n,
+                     double *energy) {
+    for (size_t i = 0; i < n; i++) {
+        double y = f.highpass(f.shelf(src[i]));
+        energy[i] += weight * y * y;
+    }
+}
+
+// k_weight_scalar() for two channels at once, one per vector lane: each
+// filter feeds back on its own last outputs, so it is across channels,
+// not samples, that the work vectorizes. Both filters have the same
+// coefficients; the operations run in the scalar order, so the results
+// are the same to the bit.
+#if defined(__SSE2__)
+
+void k_weight_pair(KFilter &f0, KFilter &f1, const float *s0,
+                   const float *s1, double w0, double w1, size_t n,
+                   double *energy) {
+    Biquad *lo[2] = {&f0.shelf, &f0.highpass};
+    Biquad *hi[2] = {&f1.shelf, &f1.highpass};
+    __m128d b0[2], b1[2], b2[2], a1[2], a2[2];
+    __m128d x1[2], x2[2], y1[2], y2[2];
+    for (int s = 0; s < 2; s++) {
+        b0[s] = _mm_set1_pd(lo[s]->b0);
+        b1[s] = _mm_set1_pd(lo[s]->b1);
+        b2[s] = _mm_set1_pd(lo[s]->b2);
+        a1[s] = _mm_set1_pd(lo[s]->a1);
+        a2[s] = _mm_set1_pd(lo[s]->a2);
+        x1[s] = _mm_set_pd(hi[s]->x1, lo[s]->x1);
+        x2[s] = _mm_set_pd(hi[s]->x2, lo[s]->x2);
+        y1[s] = _mm_set_pd(hi[s]->y1, lo[s]->y1);
+        y2[s] = _mm_set_pd(hi[s]->y2, lo[s]->y2);
+    }
+    const __m128d w = _mm_set_pd(w1, w0);
+    for (size_t i = 0; i < n; i++) {
+        __m128d v = _mm_set_pd(s1[i], s0[i]);
+        for (int s = 0; s < 2; s++) {
+            __m128d y = _mm_add_pd(_mm_mul_pd(b0[s], v),
+                                   _mm_mul_pd(b1[s], x1[s]));
+            y = _mm_add_pd(y, _mm_mul_pd(b2[s], x2[s]));
+            y = _mm_sub_pd(y, _mm_mul_pd(a1[s], y1[s]));
+            y = _mm_sub_pd(y, _mm_mul_pd(a2[s], y2[s]));
+            x2[s] = x1[s];
+            x1[s] = v;
+            y2[s] = y1[s];
+            y1[s] = y;
+            v = y;
+        }
+        __m128d e = _mm_mul_pd(_mm_mul_pd(w, v), v);
+        energy[i] += _mm_cvtsd_f64(e);
+        energy[i] += _mm_cvtsd_f64(_mm_unpackhi_pd(e, e));
+    }
+    for (int s = 0; s < 2; s++) {
+        _mm_storel_pd(&lo[s]->x1, x1[s]);
+        _mm_storeh_pd(&hi[s]->x1, x1[s]);
+        _mm_storel_pd(&lo[s]->x2, x2[s]);
+        _mm_storeh_pd(&hi[s]->x2, x2[s]);
+        _mm_storel_pd(&lo[s]->y1, y1[s]);
+        _mm_storeh_pd(&hi[s]->y1, y1[s]);
+        _mm_storel_pd(&lo[s]->y2, y2[s]);
+        _mm_storeh_pd(&hi[s]->y2, y2[s]);
+    }
+}
+
+#elif defined(__aarch64__)
+
+void k_weight_pair(KFilter &f0, KFilter &f1, const float *s0,
+                   const float *s1, double w0, double w1, size_t n,
+                   double *energy) {
+    Biquad *lo[2] = {&f0.shelf, &f0.highpass};
+    Biquad *hi[2] = {&f1.shelf, &f1.highpass};
+    auto pair = [](double a, double b) {
+        return vsetq_lane_f64(b, vdupq_n_f64(a), 1);
+    };
+    float64x2_t b0[2], b1[2], b2[2], a1[2], a2[2];
+    float64x2_t x1[2], x2[2], y1[2], y2[2];
+    for (int s = 0; s < 2; s++) {
+        b0[s] = vdupq_n_f64(lo[s]->b0);
+        b1[s] = vdupq_n_f64(lo[s]->b1);
+        b2[s] = vdupq_n_f64(lo[s]->b2);
+        a1[s] = vdupq_n_f64(lo[s]->a1);
+        a2[s] = vdupq_n_f64(lo[s]->a2);
+        x1[s] = pair(lo[s]->x1, hi[s]->x1);
+        x2[s] = pair(lo[s]->x2, hi[s]->x2);
+        y1[s] = pair(lo[s]->y1, hi[s]->y1);
+        y2[s] = pair(lo[s]->y2, hi[s]->y2);
+    }
+    const float64x2_t w = pair(w0, w1);
+    for (size_t i = 0; i < n; i++) {
+        float64x2_t v = pair(s0[i], s1[i]);
+        for (int s = 0; s < 2; s++) {
+            float64x2_t y =
+                vaddq_f64(vmulq_f64(b0[s], v), vmulq_f64(b1[s], x1[s]));
+            y = vaddq_f64(y, vmulq_f64(b2[s], x2[s]));
+            y = vsubq_f64(y, vmulq_f64(a1[s], y1[s]));
+            y = vsubq_f64(y, vmulq_f64(a2[s], y2[s]));
+            x2[s] = x1[s];
+            x1[s] = v;
+            y2[s] = y1[s];
+            y1[s] = y;
+            v = y;
+        }
+        float64x2_t e = vmulq_f64(vmulq_f64(w, v), v);
+        energy[i] += vgetq_lane_f64(e, 0);
+        energy[i] += vgetq_lane_f64(e, 1);
+    }
+    for (int s = 0; s < 2; s++) {
+        lo[s]->x1 = vgetq_lane_f64(x1[s], 0);
+        hi[s]->x1 = vgetq_lane_f64(x1[s], 1);
+        lo[s]->x2 = vgetq_lane_f64(x2[s], 0);
+        hi[s]->x2 = vgetq_lane_f64(x2[s], 1);
+        lo[s]->y1 = vgetq_lane_f64(y1[s], 0);
+        hi[s]->y1 = vgetq_lane_f64(y1[s], 1);
+        lo[s]->y2 = vgetq_lane_f64(y2[s], 0);
+        hi[s]->y2 = vgetq_lane_f64(y2[s], 1);
+    }
+}
+
+#else
+
+void k_weight_pair(KFilter &f0, KFilter &f1, const float *s0,
+                   const float *s1, double w0, double w1, size_t n,
+                   double *energy) {
+    k_weight_scalar(f0, s0, w0, n, energy);
+    k_weight_scalar(f1, s1, w1, n, energy);
+}
+
+#endif
+
+// Channel weight of BS.1770: surrounds count 1.41, the LFE not at all
+double channel_weight(const AVChannelLayout *layout, int c) {
+    switch (av_channel_layout_channel_from_index(layout, c)) {
+        case AV_CHAN_LOW_FREQUENCY:
+            return 0.0;
+        case AV_CHAN_BACK_LEFT:
+        case AV_CHAN_BACK_RIGHT:
+        case AV_CHAN_SIDE_LEFT:
+        case AV_CHAN_SIDE_RIGHT:
+            return 1.41;
+        default:
+            return 1.0;
+    }
+}
+
+double to_lufs(double power) { return -0.691 + 10.0 * std::log10(power); }
+
+// Per-channel measuring state, fed one decoded frame at a time
+struct Meter {
+    struct Channel {
+        KFilter filter;
+        double weight = 1.0;
+        std::vector<float> history;  // TAPS - 1 samples, then the frame
+    };
+    std::vector<Channel> channels;
+    int64_t sub_len = 0;  // samples per 100 ms
+    int64_t sub_pos = 0;
+    double sub_sum = 0;
+    std::vector<double> subs;  // weighted mean square per 100 ms
+    std::vector<double> energy;
+    float peak = 0;
+
+    Meter(int rate, const AVChannelLayout *layout)
+        : channels(layout->nb_channels), sub_len(std::max(rate / 10, 1)) {
+        for (int c = 0; c < layout->nb_channels; c++) {
+            k_weighting(rate, channels[c].filter);
+            channels[c].weight = channel_weight(layout, c);
+            channels[c].history.assign(TAPS - 1, 0.0f);
+        }
+    }
+
+    void add(const AVFrame *f) {
+        size_t n = f->nb_samples;
+        energy.assign(n, 0.0);
+        for (size_t c = 0; c < channels.size(); c++) {
+            Channel &ch = channels[c];
+            const float *src = (const float *)f->extended_data[c];
+
+            ch.history.resize(TAPS - 1);
+            ch.history.insert(ch.history.end(), src, src + n);
+            peak = std::max(peak, peak_impl(ch.history.data() + TAPS - 1, n));
+            ch.history.erase(ch.history.begin(), ch.history.end() - (TAPS - 1));
+        }
+        // Weighted channels two at a time, the odd one out on its own
+        Channel *held = nullptr;
+        const float *held_src = nullptr;
+        for (size_t c = 0; c < channels.size(); c++) {
+            Channel &ch = channels[c];
+            const float *src = (const float *)f->extended_data[c];
+            if (ch.weight == 0.0) {
+                continue;
+            }
+            if (!held) {
+                held = &ch;
+                held_src = src;
+                continue;
+            }
+            k_weight_pair(held->filter, ch.filter, held_src, src,
+                          held->weight, ch.weight, n, energy.data());
+            held = nullptr;
+        }
+        if (held) {
+            k_weight_scalar(held->filter, held_src, held->weight, n,
+                            energy.data());
+        }
+        for (size_t i = 0; i < n; i++) {
+            sub_sum += energy[i];
+            if (++sub_pos == sub_len) {
+                subs.push_back(sub_sum / sub_len);
+                sub_sum = 0;
+                sub_pos = 0;
+            }
+        }
+    }
+
+    // Gated integrated loudness over 400 ms blocks overlapping by 75%
+    double integrated() const {
+        std::vector<double> blocks;
+        for (size_t j = 3; j < subs.size(); j++) {
+            blocks.push_back((subs[j - 3] + subs[j - 2] + subs[j - 1] +
+                              subs[j]) / 4.0);
+        }
+        const double absolute = std::pow(10.0, (-70.0 + 0.691) / 10.0);
+        double sum = 0;
+        size_t count = 0;
+        for (double z : blocks) {
+            if (z > absolute) {
+                sum += z;
+                count++;
+            }
+        }
+        if (count == 0) {
+            return -HUGE_VAL;
+        }
+        // Relative gate: 10 LU below the loudness of the blocks above the
+        // absolute gate
+        double relative = sum / count * std::pow(10.0, -10.0 / 10.0);
+        double gated = 0;
+        count = 0;
+        for (double z : blocks) {
+            if (z > absolute && z > relative) {
+                gated += z;
+                count++;
+            }
+        }
+        return to_lufs(gated / count);
+    }
+};
+
+// Everything one measurement holds, released in any case
+struct Decoder {
+    AVFormatContext *ctx = nullptr;
+    AVCodecContext *dec = nullptr;
+    SwrContext *swr = nullptr;
+    AVPacket *pkt = nullptr;
+    AVFrame *frame = nullptr;
+    AVFrame *conv = nullptr;
+
+    ~Decoder() {
+        av_frame_free(&conv);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        swr_free(&swr);
+        avcodec_free_context(&dec);
+        avformat_close_input(&ctx);
+    }
+};
+
+}  // namespace
+
+Loudness measure_loudness(const std::string &path) {
+    Decoder d;
+    if (avformat_open_input(&d.ctx, path.c_str(), nullptr, nullptr) < 0) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    const AVCodec *decoder = nullptr;
+    int idx = av_find_best_stream(d.ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder,
+                                  0);
+    if (idx < 0 || !decoder) {
+        throw std::runtime_error("No decodable audio in " + path);
+    }
+    d.dec = avcodec_alloc_context3(decoder);
+    if (!d.dec ||
+        avcodec_parameters_to_context(d.dec, d.ctx->streams[idx]->codecpar) <
+            0 ||
+        avcodec_open2(d.dec, decoder, nullptr) < 0) {
+        throw std::runtime_error("Could not open decoder");
+    }
+    // Measured at the decoded rate, so HE-AAC is measured with its SBR band
+    if (swr_alloc_set_opts2(&d.swr, &d.dec->ch_layout, AV_SAMPLE_FMT_FLTP,
+                            d.dec->sample_rate, &d.dec->ch_layout,
+                            d.dec->sample_fmt, d.dec->sample_rate, 0,
+                            nullptr) < 0 ||
+        swr_init(d.swr) < 0) {
+        throw std::runtime_error("Could not set up resampler");
+    }
+    d.pkt = av_packet_alloc();
+    d.frame = av_frame_alloc();
+    d.conv = av_frame_alloc();
+    if (!d.pkt || !d.frame || !d.conv) {
+        throw std::runtime_error("Out of memory");
+    }
+
+    Meter meter(d.dec->sample_rate, &d.dec->ch_layout);
+    auto drain = [&] {
+        while (avcodec_receive_frame(d.dec, d.frame) == 0) {
+            av_frame_unref(d.conv);
+            d.conv->format = AV_SAMPLE_FMT_FLTP;
+            d.conv->sample_rate = d.dec->sample_rate;
+            av_channel_layout_copy(&d.conv->ch_layout, &d.dec->ch_layout);
+            if (swr_convert_frame(d.swr, d.conv, d.frame) < 0) {
+                throw std::runtime_error("Resampling failed");
+            }
+            av_frame_unref(d.frame);
+            meter.add(d.conv);
+        }
+    };
+    while (av_read_frame(d.ctx, d.pkt) >= 0) {
+        // A damaged packet is skipped, as a player would
+        if (d.pkt->stream_index == idx &&
+            avcodec_send_packet(d.dec, d.pkt) == 0) {
+            drain();
+        }
+        av_packet_unref(d.pkt);
+    }
+    avcodec_send_packet(d.dec, nullptr);
+    drain();
+
+    Loudness result;
+    result.integrated = meter.integrated();
+    result.true_peak = 20.0 * std::log10(meter.peak);
+    return result;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+
+// Loudness of a track per EBU R128 (ITU-R BS.1770-4)
+struct Loudness {
+    float integrated = NAN;  // LUFS, NAN when not measured
+    float true_peak = NAN;   // dBTP
+
+    bool measured() const { return !std::isnan(integrated); }
+};
+
+// Decodes the audio of `path` and measures integrated loudness (gated,
+// K-weighted) and true peak (4x oversampled). Throws std::runtime_error.
+Loudness measure_loudness(const std::string &path);
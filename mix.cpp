@@ -0,0 +1,84 @@
+#include "mix.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+void mix_ramp_scalar(float *out, const float *a, const float *b, size_t n,
+                     float gain, float step) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = a[i] + (b[i] - a[i]) * (gain + i * step);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2,fma"))) void mix_ramp_avx2(
+    float *out, const float *a, const float *b, size_t n, float gain,
+    float step) {
+    // The gain is computed from the index rather than accumulated, so it
+    // doesn't drift over a long fade
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 v_step = _mm256_set1_ps(step);
+    const __m256 v_gain = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 idx = _mm256_add_ps(_mm256_set1_ps((float)i), lanes);
+        __m256 g = _mm256_fmadd_ps(idx, v_step, v_gain);
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        _mm256_storeu_ps(out + i,
+                         _mm256_fmadd_ps(_mm256_sub_ps(vb, va), g, va));
+    }
+    mix_ramp_scalar(out + i, a + i, b + i, n - i, gain + i * step, step);
+}
+
+using MixFn = void (*)(float *, const float *, const float *, size_t, float,
+                       float);
+
+MixFn pick_mix() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return mix_ramp_avx2;
+    }
+    return mix_ramp_scalar;
+}
+
+const MixFn mix_impl = pick_mix();
+
+#elif defined(__ARM_NEON)
+
+void mix_ramp_neon(float *out, const float *a, const float *b, size_t n,
+                   float gain, float step) {
+    const float lane_init[4] = {0, 1, 2, 3};
+    const float32x4_t lanes = vld1q_f32(lane_init);
+    const float32x4_t v_gain = vdupq_n_f32(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t idx = vaddq_f32(vdupq_n_f32((float)i), lanes);
+        float32x4_t g = vmlaq_n_f32(v_gain, idx, step);
+        float32x4_t va = vld1q_f32(a + i);
+        float32x4_t vb = vld1q_f32(b + i);
+        vst1q_f32(out + i, vmlaq_f32(va, vsubq_f32(vb, va), g));
+    }
+    mix_ramp_scalar(out + i, a + i, b + i, n - i, gain + i * step, step);
+}
+
+const auto mix_impl = mix_ramp_neon;
+
+#else
+
+const auto mix_impl = mix_ramp_scalar;
+
+#endif
+
+}  // namespace
+
+void mix_ramp(float *out, const float *a, const float *b, size_t n,
+              float gain, float step) {
+    mix_impl(out, a, b, n, gain, step);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+
+// out[i] = a[i] + (b[i] - a[i]) * (gain + i * step)
+//
+// A linear crossfade from `a` to `b` over one channel. Uses AVX2/FMA or
+// NEON when the CPU has them, picked once at startup.
+void mix_ramp(float *out, const float *a, const float *b, size_t n,
+              float gain, float step);
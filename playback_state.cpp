@@ -0,0 +1,148 @@
+#include "playback_state.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+const char STATE_MAGIC[8] = {'I', 'C', 'E', 'F', 'S', 'T', 'A', 'T'};
+const uint32_t STATE_VERSION = 2;
+
+void copy_name(char *dst, const std::string &src) {
+    if (src.size() >= (size_t)PlaybackState::MAX_NAME) {
+        dst[0] = 0;  // too long to keep, resume just skips it
+        return;
+    }
+    memcpy(dst, src.c_str(), src.size() + 1);
+}
+
+}  // namespace
+
+PlaybackState::PlaybackState(const std::string &path) {
+    if (path.empty()) {
+        return;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: could not open state file " << path << "\n";
+        return;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size != sizeof(File) && ftruncate(fd, sizeof(File)) < 0) {
+        close(fd);
+        return;
+    }
+    void *p = mmap(nullptr, sizeof(File), PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "Error: could not map state file " << path << "\n";
+        return;
+    }
+    file = static_cast<File *>(p);
+    if (size != sizeof(File) ||
+        memcmp(file->magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 ||
+        file->version != STATE_VERSION) {
+        memset(static_cast<void *>(file), 0, sizeof(File));
+        file->version = STATE_VERSION;
+        memcpy(file->magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    }
+}
+
+PlaybackState::~PlaybackState() {
+    if (file) {
+        msync(file, sizeof(File), MS_ASYNC);
+        munmap(file, sizeof(File));
+    }
+}
+
+bool PlaybackState::load(Resume &out) const {
+    if (!file) {
+        return false;
+    }
+    const Snapshot &s =
+        file->slots[file->active.load(std::memory_order_acquire) & 1];
+    int64_t pos = s.position_us.load(std::memory_order_acquire);
+    if (pos < 0 || s.track[0] == 0 ||
+        memchr(s.track, 0, MAX_NAME) == nullptr) {
+        return false;
+    }
+    auto valid = [](const char *name) {
+        return name[0] && memchr(name, 0, MAX_NAME);
+    };
+    out.track = s.track;
+    out.position_us = pos;
+    out.scheduler.picks = s.picks;
+    out.scheduler.classes.assign(
+        s.classes, s.classes + std::min<uint32_t>(s.class_count, MAX_CLASSES));
+    out.scheduler.history.clear();
+    for (uint32_t i = 0; i < s.history_len && i < (uint32_t)MAX_HISTORY;
+         i++) {
+        if (valid(s.history[i])) {
+            out.scheduler.history.push_back(s.history[i]);
+        }
+    }
+    out.upcoming.clear();
+    for (uint32_t i = 0; i < s.upcoming_len && i < (uint32_t)MAX_UPCOMING;
+         i++) {
+        if (valid(s.upcoming[i])) {
+            out.upcoming.push_back(
+                {s.upcoming[i], ((s.upcoming_queued >> i) & 1) != 0});
+        }
+    }
+    return true;
+}
+
+void PlaybackState::track_started(const std::string &t,
+                                  const SchedulerState &sc,
+                                  const std::vector<Upcoming> &upcoming) {
+    if (!file) {
+        return;
+    }
+    track = t;
+    sched = sc;
+    publish(0, upcoming);
+}
+
+void PlaybackState::set_upcoming(const std::vector<Upcoming> &upcoming) {
+    if (!file) {
+        return;
+    }
+    const Snapshot &cur =
+        file->slots[file->active.load(std::memory_order_relaxed) & 1];
+    publish(cur.position_us.load(std::memory_order_relaxed), upcoming);
+}
+
+void PlaybackState::publish(int64_t position_us,
+                            const std::vector<Upcoming> &upcoming) {
+    uint32_t next = (file->active.load() + 1) & 1;
+    Snapshot &s = file->slots[next];
+    s.position_us.store(position_us, std::memory_order_relaxed);
+    copy_name(s.track, track);
+    s.picks = sched.picks;
+    s.class_count = std::min<size_t>(sched.classes.size(), MAX_CLASSES);
+    std::copy_n(sched.classes.begin(), s.class_count, s.classes);
+    // Keep the most recent part of the history
+    size_t skip = sched.history.size() > (size_t)MAX_HISTORY
+                      ? sched.history.size() - MAX_HISTORY
+                      : 0;
+    s.history_len = sched.history.size() - skip;
+    for (uint32_t i = 0; i < s.history_len; i++) {
+        copy_name(s.history[i], sched.history[skip + i]);
+    }
+    // and the soonest of the upcoming tracks
+    s.upcoming_len = std::min<size_t>(upcoming.size(), MAX_UPCOMING);
+    s.upcoming_queued = 0;
+    for (uint32_t i = 0; i < s.upcoming_len; i++) {
+        copy_name(s.upcoming[i], upcoming[i].name);
+        s.upcoming_queued |= (uint32_t)upcoming[i].queued << i;
+    }
+
+    file->active.store(next, std::memory_order_release);
+    msync(file, sizeof(File), MS_ASYNC);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+
+// Where playback was when the process stopped. Lives in a small mmapped
+// file: the position inside the current track is a plain store into the
+// mapping, so it can be updated every few seconds without a syscall, and
+// the page cache keeps it if the process crashes.
+//
+// Track changes are double-buffered: the new snapshot, position
+// included, goes to the inactive slot and is published by flipping
+// `active`, so a crash at any point leaves a complete snapshot to resume
+// from.
+//
+// The scheduler state is saved after the look-ahead picks were drawn, so
+// the picks are saved with it and played first on a resume.
+class PlaybackState {
+   public:
+    static const int MAX_NAME = 256;
+    static const int MAX_HISTORY = 256;
+    static const int MAX_CLASSES = 16;
+    static const int MAX_UPCOMING = 16;
+
+    // A track picked or queued to play after the current one
+    struct Upcoming {
+        std::string name;
+        bool queued;  // asked for over the control socket
+    };
+
+    struct Resume {
+        std::string track;
+        int64_t position_us = 0;
+        SchedulerState scheduler;
+        std::vector<Upcoming> upcoming;  // soonest first
+    };
+
+   private:
+    struct Snapshot {
+        std::atomic<int64_t> position_us;
+        char track[MAX_NAME];
+        uint32_t picks;
+        uint32_t class_count;
+        SchedulerState::ClassPos classes[MAX_CLASSES];
+        uint32_t history_len;
+        char history[MAX_HISTORY][MAX_NAME];
+        uint32_t upcoming_len;
+        uint32_t upcoming_queued;  // bit i: upcoming[i] was queued
+        char upcoming[MAX_UPCOMING][MAX_NAME];
+    };
+
+    struct File {
+        char magic[8];
+        uint32_t version;
+        std::atomic<uint32_t> active;
+        Snapshot slots[2];
+    };
+
+    File *file = nullptr;
+    // What the active slot holds, to publish again with new upcoming tracks
+    std::string track;
+    SchedulerState sched;
+
+    void publish(int64_t position_us, const std::vector<Upcoming> &upcoming);
+
+   public:
+    // Maps `path`, creating it if needed. An empty path or a failure to
+    // map leaves the object inert.
+    explicit PlaybackState(const std::string &path);
+    ~PlaybackState();
+
+    PlaybackState(const PlaybackState &) = delete;
+    PlaybackState &operator=(const PlaybackState &) = delete;
+
+    // What was saved by the previous run, if anything
+    bool load(Resume &out) const;
+
+    // Publishes a track change; `sched` is the scheduler state after the
+    // track and those of `upcoming` were picked
+    void track_started(const std::string &track, const SchedulerState &sched,
+                       const std::vector<Upcoming> &upcoming);
+
+    // Publishes a change to the tracks after the current one
+    void set_upcoming(const std::vector<Upcoming> &upcoming);
+
+    void set_position(int64_t us) {
+        if (file) {
+            file->slots[file->active.load(std::memory_order_relaxed) & 1]
+                .position_us.store(us, std::memory_order_release);
+        }
+    }
+};
@@ -0,0 +1,89 @@
+#include "playlist.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+std::string lower_extension(const fs::path &path) {
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+// %XX escapes of a file:// URL
+std::string percent_decode(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) &&
+            isxdigit(s[i + 2])) {
+            out += (char)std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+}  // namespace
+
+bool is_playlist(const fs::path &path) {
+    std::string ext = lower_extension(path);
+    return ext == ".m3u" || ext == ".m3u8" || ext == ".pls";
+}
+
+size_t read_playlist(const fs::path &file, const fs::path &root,
+                     const std::function<void(const std::string &)> &fn) {
+    std::ifstream is(file);
+    if (!is) {
+        throw std::runtime_error("Could not read " + file.string());
+    }
+    const bool pls = lower_extension(file) == ".pls";
+    const fs::path abs_root = fs::absolute(root).lexically_normal();
+    const fs::path base =
+        fs::absolute(file).lexically_normal().parent_path();
+
+    size_t skipped = 0;
+    std::string line;
+    while (std::getline(is, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (pls) {
+            // FileN=path; the other keys are titles and lengths
+            if (line.compare(0, 4, "File") != 0) {
+                continue;
+            }
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) {
+                continue;
+            }
+            line.erase(0, eq + 1);
+        } else if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        if (line.compare(0, 7, "file://") == 0) {
+            line = percent_decode(line.substr(7));
+        } else if (line.find("://") != std::string::npos) {
+            skipped++;
+            continue;
+        }
+        std::replace(line.begin(), line.end(), '\\', '/');
+        fs::path entry = fs::path(line).is_absolute() ? fs::path(line)
+                                                      : base / line;
+        fs::path rel = entry.lexically_normal().lexically_relative(abs_root);
+        if (rel.empty() || *rel.begin() == "..") {
+            skipped++;
+            continue;
+        }
+        fn(rel.string());
+    }
+    return skipped;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// True for the playlist formats read_playlist() understands: .m3u, .m3u8
+// and .pls
+bool is_playlist(const fs::path &path);
+
+// Reads the M3U or PLS playlist `file` line by line, handing each entry to
+// `fn` as a path relative to `root` (lexically normalized, not checked on
+// disk), so memory stays bounded however long the playlist is. Relative
+// entries are taken from the playlist's directory. Returns the number of
+// entries skipped: URLs and paths outside `root`. Throws
+// std::runtime_error if the file can't be read.
+size_t read_playlist(const fs::path &file, const fs::path &root,
+                     const std::function<void(const std::string &)> &fn);
@@ -0,0 +1,143 @@
+#include "prefetcher.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "realtime.h"
+
+Prefetcher::Prefetcher() : thread(&Prefetcher::run, this) {}
+
+Prefetcher::~Prefetcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void Prefetcher::request(const std::string &path) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (path == wanted[0] || path == wanted[1]) {
+            return;
+        }
+        wanted[1] = std::move(wanted[0]);
+        wanted[0] = path;
+        opened.erase(std::remove_if(opened.begin(), opened.end(),
+                                    [this](const Opened &o) {
+                                        return o.path != wanted[0] &&
+                                               o.path != wanted[1];
+                                    }),
+                     opened.end());
+    }
+    cv.notify_all();
+}
+
+void Prefetcher::warm(const std::string &path) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        to_warm.push_back(path);
+    }
+    cv.notify_all();
+}
+
+void Prefetcher::forget(const std::string &path) {
+    for (std::string &w : wanted) {
+        if (w == path) {
+            w.clear();
+        }
+    }
+}
+
+std::unique_ptr<InputFile> Prefetcher::take_opened(const std::string &path) {
+    auto it = std::find_if(opened.begin(), opened.end(),
+                           [&](const Opened &o) { return o.path == path; });
+    if (it == opened.end()) {
+        return nullptr;
+    }
+    forget(path);
+    Opened o = std::move(*it);
+    opened.erase(it);
+    if (!o.input) {
+        throw std::runtime_error(o.error);
+    }
+    return std::move(o.input);
+}
+
+std::unique_ptr<InputFile> Prefetcher::take(const std::string &path) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return opening != path; });
+        if (auto input = take_opened(path)) {
+            return input;
+        }
+        forget(path);
+    }
+    return std::make_unique<InputFile>(path);
+}
+
+std::unique_ptr<InputFile> Prefetcher::try_take(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return take_opened(path);
+}
+
+std::string Prefetcher::to_open() const {
+    // The older request plays first
+    for (int i = 1; i >= 0; i--) {
+        const std::string &path = wanted[i];
+        if (!path.empty() && path != opening &&
+            std::none_of(opened.begin(), opened.end(),
+                         [&](const Opened &o) { return o.path == path; })) {
+            return path;
+        }
+    }
+    return "";
+}
+
+void Prefetcher::run() {
+    make_thread_background();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] {
+            return stopping || !to_open().empty() || !to_warm.empty();
+        });
+        if (stopping) {
+            return;
+        }
+        std::string path = to_open();
+        if (path.empty()) {
+            path = std::move(to_warm.front());
+            to_warm.pop_front();
+            lock.unlock();
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+            lock.lock();
+            continue;
+        }
+        opening = path;
+        lock.unlock();
+
+        // A file that fails isn't retried; take() reports the error
+        Opened o;
+        o.path = path;
+        try {
+            o.input = std::make_unique<InputFile>(path);
+        } catch (const std::exception &e) {
+            o.error = e.what();
+        }
+
+        lock.lock();
+        opening.clear();
+        if (path == wanted[0] || path == wanted[1]) {
+            opened.push_back(std::move(o));
+        }
+        cv.notify_all();
+    }
+}
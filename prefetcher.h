@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "input_file.h"
+
+// Opens the upcoming track on a background thread while the current one
+// plays, so the next track (or the one after a broken file) starts without
+// waiting for the open and stream probing. Tracks further ahead are read
+// into the page cache.
+//
+// The two latest requests are kept: asking for the track after next
+// doesn't throw away the next one before it was taken.
+class Prefetcher {
+    // An input opened ahead, or why it couldn't be
+    struct Opened {
+        std::string path;
+        std::unique_ptr<InputFile> input;
+        std::string error;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string wanted[2];  // newest first
+    std::string opening;
+    std::deque<Opened> opened;  // of paths in `wanted`
+    std::deque<std::string> to_warm;
+    bool stopping = false;
+    std::thread thread;
+
+    std::string to_open() const;
+    void forget(const std::string &path);
+    std::unique_ptr<InputFile> take_opened(const std::string &path);
+    void run();
+
+   public:
+    Prefetcher();
+    ~Prefetcher();
+
+    // Starts opening `path`, dropping any prefetch but the one requested
+    // just before
+    void request(const std::string &path);
+
+    // Asks the kernel to read `path` ahead, when there is nothing to open
+    void warm(const std::string &path);
+
+    // The opened input for `path`, waiting for a prefetch in progress or
+    // opening it here if it wasn't requested. Throws like InputFile.
+    std::unique_ptr<InputFile> take(const std::string &path);
+
+    // The opened input for `path` if its prefetch is done, nullptr if not;
+    // never waits or opens anything itself. Throws std::runtime_error if
+    // the prefetch failed.
+    std::unique_ptr<InputFile> try_take(const std::string &path);
+};
@@ -0,0 +1,252 @@
+#include "probe.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "adts.h"
+
+namespace {
+
+bool parse_itunsmpb(const AVDictionary *meta, GaplessInfo &info) {
+    AVDictionaryEntry *tag = av_dict_get(meta, "iTunSMPB", nullptr, 0);
+    if (!tag) {
+        return false;
+    }
+    // " 00000000 00000840 000001CA 00000000003F31F6 ..."
+    unsigned zero, delay, padding;
+    uint64_t samples;
+    if (sscanf(tag->value, " %x %x %x %" SCNx64, &zero, &delay, &padding,
+               &samples) != 4) {
+        return false;
+    }
+    info.delay = delay;
+    info.padding = padding;
+    info.valid_samples = samples > 0 ? (int64_t)samples : -1;
+    return true;
+}
+
+}  // namespace
+
+GaplessInfo probe_gapless(const AVFormatContext *ctx, const AVStream *st) {
+    GaplessInfo info;
+    if (parse_itunsmpb(ctx->metadata, info) ||
+        parse_itunsmpb(st->metadata, info)) {
+        return info;
+    }
+    info.delay = st->codecpar->initial_padding;
+    info.padding = st->codecpar->trailing_padding;
+    return info;
+}
+
+GaplessWindow gapless_window(const GaplessInfo &info, const AVStream *st,
+                             int64_t first_pts) {
+    AVRational samples_tb = {1, st->codecpar->sample_rate};
+    GaplessWindow win;
+
+    if (first_pts < 0) {
+        // Edit list already applied by the demuxer: priming has negative
+        // timestamps and the edit duration is the stream duration
+        win.begin = 0;
+        if (info.valid_samples > 0) {
+            win.end = av_rescale_q(info.valid_samples, samples_tb,
+                                   st->time_base);
+        } else if (st->duration > 0 && st->duration != AV_NOPTS_VALUE) {
+            win.end = st->duration;
+        }
+    } else {
+        win.begin = first_pts + av_rescale_q(info.delay, samples_tb,
+                                             st->time_base);
+        if (info.valid_samples > 0) {
+            win.end = win.begin + av_rescale_q(info.valid_samples,
+                                               samples_tb, st->time_base);
+        } else if (info.padding > 0 && st->duration > 0 &&
+                   st->duration != AV_NOPTS_VALUE) {
+            win.end = first_pts + st->duration -
+                      av_rescale_q(info.padding, samples_tb, st->time_base);
+        }
+    }
+    return win;
+}
+
+GaplessWindow track_window(const AVFormatContext *ctx, AVStream *st) {
+    int entries = avformat_index_get_entries_count(st);
+    if (entries <= 0) {
+        return GaplessWindow();
+    }
+    int64_t first_ts = avformat_index_get_entry(st, 0)->timestamp;
+    GaplessWindow win = gapless_window(probe_gapless(ctx, st), st, first_ts);
+    if (win.end == INT64_MAX) {
+        if (st->duration > 0 && st->duration != AV_NOPTS_VALUE) {
+            win.end = first_ts < 0 ? st->duration : first_ts + st->duration;
+        } else {
+            win.end = avformat_index_get_entry(st, entries - 1)->timestamp +
+                      av_rescale_q(1024, {1, st->codecpar->sample_rate},
+                                   st->time_base);
+        }
+    }
+    return win;
+}
+
+std::string track_title(const AVFormatContext *ctx) {
+    auto tag = [&](const char *key) -> std::string {
+        AVDictionaryEntry *e = av_dict_get(ctx->metadata, key, nullptr, 0);
+        return e ? e->value : "";
+    };
+    std::string title = tag("title");
+    if (title.empty()) {
+        std::string name = ctx->url ? ctx->url : "";
+        name = name.substr(name.rfind('/') + 1);
+        return name.substr(0, name.rfind('.'));
+    }
+    std::string artist = tag("artist");
+    return artist.empty() ? title : artist + " - " + title;
+}
+
+const char *track_status_name(TrackStatus status) {
+    switch (status) {
+        case TrackStatus::OK:
+            return "ok";
+        case TrackStatus::UNREADABLE:
+            return "unreadable";
+        case TrackStatus::NO_AUDIO:
+            return "no audio stream";
+        case TrackStatus::NOT_AAC:
+            return "not AAC";
+        case TrackStatus::BAD_CONFIG:
+            return "AAC configuration not supported by ADTS";
+        case TrackStatus::TRUNCATED:
+            return "truncated";
+    }
+    return "unknown";
+}
+
+// Hash of the audio of `st` that costs a bounded amount of I/O whatever
+// the file's length: the size of every sample, which the sample table
+// already holds, plus the payload of a few runs of samples at the start,
+// middle and end. 0 if the file can't be read. Hashing the whole payload
+// instead would read the entire library before the first scan publishes.
+static uint64_t payload_fingerprint(const AVFormatContext *ctx,
+                                    AVStream *st) {
+    // Per run; three runs read at most this each
+    const int64_t RUN_BYTES = 64 * 1024;
+    int fd = open(ctx->url, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    auto mix = [&h](uint64_t word) {
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    };
+    int entries = avformat_index_get_entries_count(st);
+    for (int i = 0; i < entries; i++) {
+        mix(avformat_index_get_entry(st, i)->size);
+    }
+
+    std::vector<char> buf;
+    bool ok = true;
+    int starts[] = {0, entries / 2, entries};
+    for (int &start : starts) {
+        // Back from the end far enough to fill a run
+        if (start == entries) {
+            int64_t bytes = 0;
+            while (start > 0 &&
+                   bytes + avformat_index_get_entry(st, start - 1)->size <=
+                       RUN_BYTES) {
+                bytes += avformat_index_get_entry(st, --start)->size;
+            }
+        }
+        // Sample by sample, so the hash doesn't depend on how the samples
+        // are laid out in the file
+        int64_t bytes = 0;
+        for (int k = start; ok && k < entries; k++) {
+            const AVIndexEntry *e = avformat_index_get_entry(st, k);
+            if (bytes > 0 && bytes + e->size > RUN_BYTES) {
+                break;
+            }
+            buf.resize(e->size);
+            ok = pread(fd, buf.data(), buf.size(), e->pos) ==
+                 (ssize_t)buf.size();
+            const char *data = buf.data();
+            int j = 0;
+            for (; ok && j + 8 <= e->size; j += 8) {
+                uint64_t word;
+                memcpy(&word, data + j, 8);
+                mix(word);
+            }
+            for (; ok && j < e->size; j++) {
+                mix((unsigned char)data[j]);
+            }
+            bytes += e->size;
+        }
+    }
+    close(fd);
+    if (!ok) {
+        return 0;
+    }
+    // 0 stays free for "unknown"
+    return h ? h : 1;
+}
+
+static TrackStatus validate(AVFormatContext *ctx, TrackProbe &out) {
+    int idx = av_find_best_stream(ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (idx < 0) {
+        return TrackStatus::NO_AUDIO;
+    }
+    AVStream *st = ctx->streams[idx];
+    if (st->codecpar->codec_id != AV_CODEC_ID_AAC) {
+        return TrackStatus::NOT_AAC;
+    }
+    try {
+        out.adts_key = AdtsFramer(st->codecpar).key();
+    } catch (const std::exception &) {
+        return TrackStatus::BAD_CONFIG;
+    }
+
+    // The MP4 demuxer loads the whole sample table on open, so checking
+    // that the last sample lies inside the file costs no extra reads
+    int entries = avformat_index_get_entries_count(st);
+    if (entries <= 0) {
+        return TrackStatus::TRUNCATED;
+    }
+    const AVIndexEntry *last = avformat_index_get_entry(st, entries - 1);
+    int64_t file_size = avio_size(ctx->pb);
+    if (file_size > 0 && last->pos + last->size > file_size) {
+        return TrackStatus::TRUNCATED;
+    }
+
+    // Playing time between encoder delay and padding, as streamed
+    GaplessWindow win = track_window(ctx, st);
+    out.duration_us = std::max<int64_t>(
+        av_rescale_q(win.end - win.begin, st->time_base, AV_TIME_BASE_Q), 0);
+    out.fingerprint = payload_fingerprint(ctx, st);
+    return TrackStatus::OK;
+}
+
+bool probe_track(const std::string &path, TrackProbe &out) {
+    AVFormatContext *ctx = nullptr;
+    out.status = TrackStatus::UNREADABLE;
+    if (avformat_open_input(&ctx, path.c_str(), nullptr, nullptr) < 0) {
+        return false;
+    }
+    out.status = validate(ctx, out);
+    auto tag = [&](const char *key) -> std::string {
+        AVDictionaryEntry *e = av_dict_get(ctx->metadata, key, nullptr, 0);
+        return e ? e->value : "";
+    };
+    out.artist = tag("artist");
+    if (out.artist.empty()) {
+        out.artist = tag("album_artist");
+    }
+    out.album = tag("album");
+    avformat_close_input(&ctx);
+    return true;
+}
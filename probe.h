@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "loudness.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Encoder delay/padding of an AAC track as stored by the encoder, in samples
+struct GaplessInfo {
+    int64_t delay = 0;
+    int64_t padding = 0;
+    int64_t valid_samples = -1;  // -1 when unknown
+};
+
+// Reads gapless info from the iTunSMPB tag, falling back to the edit list
+// (which libavformat applies as negative timestamps on the priming packets
+// and as the stream duration) and codecpar->initial_padding. No decoding.
+GaplessInfo probe_gapless(const AVFormatContext *ctx, const AVStream *st);
+
+// The span of real audio on the stream's own timestamp scale
+struct GaplessWindow {
+    int64_t begin = 0;
+    int64_t end = INT64_MAX;
+
+    // Packets that decode to priming samples only
+    bool is_priming(const AVPacket *pkt) const {
+        return pkt->pts + pkt->duration <= begin;
+    }
+    // Packets that decode to padding samples only
+    bool is_padding(const AVPacket *pkt) const { return pkt->pts >= end; }
+};
+
+// Places `info` on the timestamp scale of `st`, given the pts of the first
+// packet the demuxer returned
+GaplessWindow gapless_window(const GaplessInfo &info, const AVStream *st,
+                             int64_t first_pts);
+
+// The window placed by the sample table alone, without reading packets.
+// The end falls back to the stream duration when the file has no gapless
+// info, so it is always finite for a file with a sample table.
+GaplessWindow track_window(const AVFormatContext *ctx, AVStream *st);
+
+// "Artist - Title" from the tags, or the file name without extension
+std::string track_title(const AVFormatContext *ctx);
+
+// Outcome of validating a file; anything but OK keeps it off the air
+enum class TrackStatus : uint8_t {
+    OK,
+    UNREADABLE,  // can't be opened or parsed
+    NO_AUDIO,
+    NOT_AAC,
+    BAD_CONFIG,  // AAC configuration ADTS can't carry
+    TRUNCATED,   // sample table points past the end of the file
+};
+
+const char *track_status_name(TrackStatus status);
+
+// What the library index keeps about a file. Everything but the loudness
+// is read from its container without decoding; the loudness is measured
+// later (Library::analyze), as that means decoding the whole file.
+struct TrackProbe {
+    std::string artist;
+    std::string album;
+    TrackStatus status = TrackStatus::UNREADABLE;
+    uint32_t adts_key = 0;  // AdtsFramer::key() of the audio stream
+    int64_t duration_us = 0;  // without encoder delay and padding
+    // Hash of the AAC frame sizes and some of the payload, never the tags,
+    // so copies with different tags or names match; 0 if unknown
+    uint64_t fingerprint = 0;
+    Loudness loudness;
+};
+
+// Opens `path`, reads its tags and validates it: AAC audio that ADTS can
+// carry, with a sample table that fits in the file. A valid file gets a
+// fingerprint from a few hundred KiB of its payload. Returns false if the
+// file can't be opened.
+bool probe_track(const std::string &path, TrackProbe &out);
@@ -0,0 +1,98 @@
+#include "realtime.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Stack touched up front so the pacing loop never faults in a stack page
+const size_t PREFAULT_STACK_SIZE = 256 * 1024;
+
+void prefault_stack() {
+    volatile unsigned char buf[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(buf); i += 4096) {
+        buf[i] = 0;
+    }
+}
+
+// CPUs the process may run on as started (taskset, cpuset), read before
+// main() so before any thread is pinned
+cpu_set_t startup_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        for (long i = 0, n = sysconf(_SC_NPROCESSORS_CONF); i < n; i++) {
+            CPU_SET(i, &set);
+        }
+    }
+    return set;
+}
+
+const cpu_set_t STARTUP_CPUS = startup_cpus();
+
+}  // namespace
+
+void make_thread_realtime(const RealtimeConfig &cfg) {
+    if (cfg.lock_memory) {
+        // Keep freed heap inside the process so that packet buffers are
+        // recycled from already locked pages instead of mmap/munmap
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            throw std::runtime_error(std::string("mlockall failed: ") +
+                                     strerror(errno));
+        }
+        prefault_stack();
+    }
+
+    if (cfg.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cfg.cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            throw std::runtime_error("Could not pin to CPU " +
+                                     std::to_string(cfg.cpu) + ": " +
+                                     strerror(err));
+        }
+    }
+
+    if (cfg.priority > 0) {
+        struct sched_param param = {};
+        param.sched_priority = cfg.priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            throw std::runtime_error(
+                std::string("Could not set SCHED_FIFO priority: ") +
+                strerror(err));
+        }
+    }
+}
+
+void make_thread_background() {
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(STARTUP_CPUS),
+                           &STARTUP_CPUS);
+
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+}
+
+void make_thread_idle() {
+    make_thread_background();
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    // The idle I/O class: disk reads of batch jobs wait for everyone else's.
+    // No glibc wrapper; 1 is IOPRIO_WHO_PROCESS, 3 IOPRIO_CLASS_IDLE.
+    syscall(SYS_ioprio_set, 1, (int)syscall(SYS_gettid), 3 << 13);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Scheduling setup for the pacing thread
+struct RealtimeConfig {
+    int priority = 0;  // SCHED_FIFO priority, 0 keeps SCHED_OTHER
+    int cpu = -1;      // CPU to pin the pacing thread to, -1 for any
+    bool lock_memory = false;
+};
+
+// Applies `cfg` to the calling thread. Memory locking affects the whole
+// process. Throws std::runtime_error if a requested setting is refused
+// (typically missing CAP_SYS_NICE / CAP_IPC_LOCK or rtprio limits).
+void make_thread_realtime(const RealtimeConfig &cfg);
+
+// Drops the calling thread to SCHED_OTHER at nice 10 (a low priority) and
+// replaces the CPU pinning inherited from a realtime parent with the CPUs
+// the process was started on, so taskset and cpusets still hold. Helper
+// threads started from the pacing thread call this first so they never
+// compete with it.
+void make_thread_background();
+
+// make_thread_background() plus SCHED_IDLE and the idle I/O class, for
+// batch work that should only run when the CPU and disk have nothing else
+// to do
+void make_thread_idle();
@@ -0,0 +1,268 @@
+#include "rendition.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "realtime.h"
+
+namespace {
+
+// About 6 s of AAC at 44.1 kHz, to ride out a stalled server before
+// dropping
+const size_t SLOT_COUNT = 256;
+// Wait between attempts to connect the output
+const std::chrono::seconds RETRY(5);
+
+}  // namespace
+
+Rendition::Rendition(const fs::path &dir, const std::string &u)
+    : root(dir), url(u), pkt(av_packet_alloc()) {
+    if (!pkt) {
+        throw std::runtime_error("Out of memory");
+    }
+    make_sink(sink, url);
+    slots.resize(SLOT_COUNT);
+    sem_init(&filled, 0, 0);
+}
+
+Rendition::~Rendition() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    sem_post(&filled);
+    if (thread.joinable()) {
+        thread.join();
+    }
+    sem_destroy(&filled);
+    close_track();
+    av_packet_free(&pkt);
+}
+
+void Rendition::open() {
+    if (!thread.joinable()) {
+        thread = std::thread(&Rendition::run, this);
+    }
+}
+
+bool Rendition::connect() {
+    try {
+        std::visit([](auto &out) { out.open(); }, sink);
+        sink_ok = true;
+        if (!title.empty()) {
+            std::visit([&](auto &out) { out.set_title(title); }, sink);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: rendition " << root << ": " << e.what() << "\n";
+    }
+    return sink_ok;
+}
+
+void Rendition::run() {
+    make_thread_background();
+    bool opened = false;
+    while (!stopping) {
+        if (!sink_ok) {
+            // Frames that piled up meanwhile are stale; drop them, but
+            // keep the title for when the output is back
+            while (Slot *slot = next_queued(false)) {
+                if (slot->track_start) {
+                    title = slot->title;
+                }
+                release_slot();
+            }
+            dropped = 0;
+            if (opened) {
+                make_sink(sink, url);  // from scratch after a failure
+            }
+            opened = true;
+            if (!connect()) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait_for(lock, RETRY, [this] { return stopping.load(); });
+            }
+            continue;
+        }
+        Slot *slot = next_queued(true);
+        if (!slot) {
+            continue;
+        }
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            std::cerr << "Rendition " << root << ": output too slow, " << lost
+                      << " frames dropped\n";
+        }
+        if (slot->track_start) {
+            title = slot->title;
+            std::visit([](auto &out) { out.start_track(); }, sink);
+            if (!title.empty()) {
+                std::visit([&](auto &out) { out.set_title(title); }, sink);
+            }
+        } else {
+            int hdr_size = AdtsFramer::HEADER_SIZE;
+            bool ok = std::visit(
+                [&](auto &out) {
+                    return out.write_frame(slot->data, hdr_size,
+                                           slot->data + hdr_size,
+                                           slot->size - hdr_size);
+                },
+                sink);
+            if (!ok) {
+                // The main mount carries on; this one reconnects
+                std::cerr << "Error: rendition " << root << ": output lost\n";
+                sink_ok = false;
+            }
+        }
+        release_slot();
+    }
+}
+
+Rendition::Slot *Rendition::take_slot() {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == slots.size()) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &slots[h % slots.size()];
+}
+
+void Rendition::queue() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+    sem_post(&filled);
+}
+
+Rendition::Slot *Rendition::next_queued(bool wait) {
+    while ((wait ? sem_wait(&filled) : sem_trywait(&filled)) != 0) {
+        if (errno != EINTR) {
+            return nullptr;  // none queued
+        }
+    }
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+        return nullptr;  // woken to stop
+    }
+    return &slots[t % slots.size()];
+}
+
+void Rendition::release_slot() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+}
+
+void Rendition::close_track() {
+    if (pending) {
+        av_packet_unref(pkt);
+        pending = false;
+    }
+    reader.reset();
+    input.reset();
+}
+
+void Rendition::prepare(const std::string &name) {
+    opener.request(path(name).string());
+}
+
+void Rendition::start(const std::string &name, int64_t media_us,
+                      int64_t stream_us, const std::string &title) {
+    close_track();
+    starting = true;
+    start_name = name;
+    start_media_us = media_us;
+    start_stream_us = stream_us;
+    start_title = title;
+    prepare(name);  // unless it was already
+    begin(stream_us);
+}
+
+void Rendition::begin(int64_t now_us) {
+    starting = false;
+    input = opener.try_take(path(start_name).string());
+    if (!input) {
+        starting = true;  // still opening
+        return;
+    }
+    AVStream *st = input->stream();
+    AdtsFramer f(st->codecpar);
+    if (!framer_ready) {
+        framer = f;
+        framer_ready = true;
+    } else if (f != framer) {
+        input.reset();
+        throw std::runtime_error("Variant configuration differs from mount");
+    }
+    time_base = st->time_base;
+    reader = std::make_unique<TrackReader>(*input);
+
+    // Joining late leaves out what the stream played meanwhile
+    int64_t late_us = std::max<int64_t>(now_us - start_stream_us, 0);
+    anchor_pts =
+        reader->gapless().begin +
+        av_rescale_q(start_media_us + late_us, AV_TIME_BASE_Q, time_base);
+    anchor_us = start_stream_us + late_us;
+    try {
+        reader->start_at(anchor_pts);
+    } catch (const std::exception &) {
+        close_track();
+        throw;
+    }
+    if (Slot *slot = take_slot()) {
+        slot->track_start = true;
+        slot->title = start_title;
+        queue();
+    }
+}
+
+void Rendition::write(const AVPacket *p) {
+    uint8_t hdr[AdtsFramer::HEADER_SIZE];
+    if (!framer.header(hdr, p->size)) {
+        return;
+    }
+    Slot *slot = take_slot();
+    if (!slot) {
+        return;
+    }
+    slot->track_start = false;
+    slot->size = sizeof(hdr) + p->size;
+    memcpy(slot->data, hdr, sizeof(hdr));
+    memcpy(slot->data + sizeof(hdr), p->data, p->size);
+    queue();
+}
+
+void Rendition::follow(int64_t until_us) {
+    if (starting) {
+        try {
+            begin(until_us);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << path(start_name) << ": " << e.what()
+                      << "\n";
+        }
+    }
+    while (reader) {
+        if (!pending) {
+            if (!reader->next(pkt)) {
+                close_track();
+                return;
+            }
+            pending = true;
+        }
+        int64_t at_us =
+            anchor_us +
+            av_rescale_q(pkt->pts - anchor_pts, time_base, AV_TIME_BASE_Q);
+        if (at_us >= until_us) {
+            return;
+        }
+        write(pkt);
+        av_packet_unref(pkt);
+        pending = false;
+    }
+}
+
+void Rendition::finish(int64_t until_us) {
+    follow(until_us);
+    starting = false;  // the variant didn't open in time for its track
+    close_track();
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <semaphore.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "adts.h"
+#include "input_file.h"
+#include "prefetcher.h"
+#include "sink.h"
+#include "track_reader.h"
+
+namespace fs = std::filesystem;
+
+// A further mount streaming another pre-encoded variant of every track
+// (e.g. a 64 kbit/s copy) from a directory tree that mirrors the music
+// directory. A rendition has no clock or schedule of its own: the main
+// stream tells it when a track starts and how far the stream has got, and
+// the rendition reads its variant's packets up to that point, so all mounts
+// play the same track at the same time.
+//
+// Variants are opened ahead on a thread of the rendition's own (see
+// prepare()), and the pacing thread takes them over when their track
+// starts. One that isn't open by then joins late, where the stream has
+// got to, rather than holding up the main mount.
+//
+// The pacing thread only copies the frames into preallocated slots. A
+// writer thread of the rendition's own, at background priority, connects
+// the output and sends them, so a slow or unreachable server never delays
+// the main mount. The slots form a single-producer, single-consumer ring
+// with a semaphore counting the filled ones, so the pacing thread never
+// takes a lock the writer could be holding. When every slot is waiting for
+// the output, frames are dropped whole and the gap is logged.
+class Rendition {
+    // Room for any ADTS frame (13-bit length, header included)
+    static const int FRAME_BYTES = 8192;
+
+    // One frame, or the start of a track
+    struct Slot {
+        bool track_start = false;
+        std::string title;  // of the track starting
+        int size = 0;
+        uint8_t data[FRAME_BYTES];
+    };
+
+    fs::path root;
+    std::string url;
+    // Filled at `head` by the pacing thread, emptied at `tail` by the
+    // writer; each side only stores its own index
+    std::vector<Slot> slots;
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    sem_t filled;  // slots between tail and head, plus a stop wake-up
+    std::atomic<uint64_t> dropped{0};  // frames
+
+    // Only for the writer's waits between reconnects and for stopping
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    // Writer thread state
+    OutputSink sink;
+    bool sink_ok = false;
+    std::string title;  // repeated after a reconnect
+
+    // Pacing thread state
+    Prefetcher opener;
+    // A start waiting for its variant to open
+    bool starting = false;
+    std::string start_name;
+    int64_t start_media_us = 0;
+    int64_t start_stream_us = 0;
+    std::string start_title;
+    AdtsFramer framer;
+    bool framer_ready = false;
+    std::unique_ptr<InputFile> input;
+    std::unique_ptr<TrackReader> reader;
+    AVRational time_base = {1, 1};
+    // The packet at anchor_pts plays at stream time anchor_us
+    int64_t anchor_pts = 0;
+    int64_t anchor_us = 0;
+    AVPacket *pkt = nullptr;
+    bool pending = false;  // `pkt` read but not sent yet
+
+    Slot *take_slot();
+    void queue();
+    Slot *next_queued(bool wait);
+    void release_slot();
+    void begin(int64_t now_us);
+    void write(const AVPacket *p);
+    void close_track();
+    bool connect();
+    void run();
+
+   public:
+    // Streams the variants under `root` to the output `url` (see
+    // make_sink())
+    Rendition(const fs::path &root, const std::string &url);
+    // Drops what is still queued
+    ~Rendition();
+
+    Rendition(const Rendition &) = delete;
+    Rendition &operator=(const Rendition &) = delete;
+
+    // Starts the writer, which connects the output and keeps reconnecting
+    // it in the background after failures
+    void open();
+
+    fs::path path(const std::string &name) const { return root / name; }
+
+    // Opens the variant of `name` in the background, for the next start()
+    void prepare(const std::string &name);
+
+    // Starts the variant of `name` (relative to the music directory)
+    // `media_us` into its audio, at stream time `stream_us`. Never waits
+    // for the open. Throws std::runtime_error if the variant is already
+    // known to be missing or not to match the rendition's configuration.
+    void start(const std::string &name, int64_t media_us, int64_t stream_us,
+               const std::string &title);
+
+    // Queues the packets that play before stream time `until_us`, joining
+    // the track if its variant got opened meanwhile. Never waits for the
+    // output or the open.
+    void follow(int64_t until_us);
+
+    // Ends the current track at stream time `until_us`
+    void finish(int64_t until_us);
+};
@@ -0,0 +1,286 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Per-pick work bounds, keeping a pick O(1)
+const int DEFERRED_CHECKS = 8;
+const int MAX_DRAWS = 32;
+
+}  // namespace
+
+Scheduler::Scheduler(const ScheduleConfig &config)
+    : cfg(config), rng(std::random_device{}()) {}
+
+bool Scheduler::allowed(uint32_t id) const {
+    if (recent(track_last[id], cfg.no_repeat)) {
+        return false;
+    }
+    uint32_t artist = library->artist(id);
+    if (artist != 0 && recent(artist_last[artist], cfg.artist_separation)) {
+        return false;
+    }
+    uint32_t album = library->album(id);
+    if (album != 0 && recent(album_last[album], cfg.album_separation)) {
+        return false;
+    }
+    return true;
+}
+
+void Scheduler::mark_played(uint32_t id) {
+    picks++;
+    track_last[id] = picks;
+    artist_last[library->artist(id)] = picks;
+    album_last[library->album(id)] = picks;
+
+    history.push_back({library->name(id),
+                       library->artist_pool().str(library->artist(id)),
+                       library->album_pool().str(library->album(id))});
+    size_t keep = std::max({cfg.no_repeat, cfg.artist_separation,
+                            cfg.album_separation});
+    while (history.size() > keep) {
+        history.pop_front();
+    }
+}
+
+void Scheduler::rebuild(const Library &lib) {
+    library = &lib;
+    track_last.assign(lib.size(), 0);
+    artist_last.assign(lib.artist_pool().size(), 0);
+    album_last.assign(lib.album_pool().size(), 0);
+
+    std::vector<Class> old = std::move(classes);
+    classes.assign(std::max<size_t>(lib.rotation_count(), 1), Class());
+    for (size_t i = 0; i < cfg.rotation.size() && i < classes.size(); i++) {
+        classes[i].weight = std::max(cfg.rotation[i].weight, 0);
+        classes[i].every = cfg.rotation[i].every;
+    }
+    for (size_t i = 0; i < classes.size() && i < old.size(); i++) {
+        classes[i].since = old[i].since;
+    }
+    summary = ScheduleStats();
+    std::vector<uint8_t> schedulable(lib.size(), 0);
+    std::unordered_set<uint64_t> fingerprints;
+    fingerprints.reserve(lib.size());
+    for (uint32_t id = 0; id < lib.size(); id++) {
+        if (lib.status(id) != TrackStatus::OK) {
+            summary.quarantined++;
+            continue;
+        }
+        summary.by_config[lib.adts_key(id)]++;
+        bool mismatched = mount_key != 0 && lib.adts_key(id) != mount_key;
+        if (mismatched) {
+            summary.mismatched++;
+            if (!converted || !converted(lib, id)) {
+                continue;
+            }
+        }
+        // Only among playable tracks, so a copy the mount can't play
+        // doesn't shadow one it can
+        uint64_t fp = lib.fingerprint(id);
+        if (fp != 0 && !fingerprints.insert(fp).second) {
+            summary.duplicates++;
+            continue;
+        }
+        if (mismatched) {
+            summary.converted++;
+        }
+        summary.scheduled++;
+        schedulable[id] = 1;
+        if (!lib.playlist(lib.rotation(id))) {
+            classes[lib.rotation(id)].members.push_back(id);
+        }
+    }
+    for (size_t i = 0; i < classes.size(); i++) {
+        Class &c = classes[i];
+        if (const auto *list = lib.playlist(i)) {
+            for (uint32_t id : *list) {
+                if (schedulable[id]) {
+                    c.members.push_back(id);
+                }
+            }
+        }
+        c.members.shrink_to_fit();
+        c.is_deferred.assign(c.members.size(), false);
+        if (i < restored.size() && restored[i].size == c.members.size() &&
+            restored[i].pos <= c.members.size()) {
+            c.order = Shuffle(c.members.size(), restored[i].seed);
+            c.pos = restored[i].pos;
+        } else if (i < old.size() && old[i].order.size() == c.members.size()) {
+            // Most likely the same files with fresh index data; carry on
+            // through the cycle rather than starting a new one
+            c.order = old[i].order;
+            c.pos = old[i].pos;
+            c.current = old[i].current;
+        } else {
+            c.order = Shuffle(c.members.size(), rng());
+        }
+    }
+    restored.clear();
+
+    // Replay recent history onto the new track ids
+    auto pool_ids = [](const StringPool &pool) {
+        std::unordered_map<std::string, uint32_t> ids;
+        for (uint32_t t = 1; t < pool.size(); t++) {
+            ids.emplace(pool.str(t), t);
+        }
+        return ids;
+    };
+    auto artist_ids = pool_ids(lib.artist_pool());
+    auto album_ids = pool_ids(lib.album_pool());
+
+    uint32_t seq = picks - history.size();
+    for (auto &p : history) {
+        seq++;
+        uint32_t id = lib.find(p.name);
+        if (id != Library::NOT_FOUND) {
+            track_last[id] = seq;
+            if (p.artist.empty() && p.album.empty()) {
+                p.artist = lib.artist_pool().str(lib.artist(id));
+                p.album = lib.album_pool().str(lib.album(id));
+            }
+        }
+        auto artist = artist_ids.find(p.artist);
+        if (artist != artist_ids.end()) {
+            artist_last[artist->second] = seq;
+        }
+        auto album = album_ids.find(p.album);
+        if (album != album_ids.end()) {
+            album_last[album->second] = seq;
+        }
+    }
+}
+
+void Scheduler::set_mount(uint32_t key) {
+    if (key == mount_key) {
+        return;
+    }
+    mount_key = key;
+    if (library) {
+        rebuild(*library);
+    }
+}
+
+bool Scheduler::empty() const {
+    for (const auto &c : classes) {
+        if (!c.members.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t Scheduler::pick_from(Class &c) {
+    // Earlier deferrals first, they are the likeliest to be allowed now
+    int checks = std::min<int>(DEFERRED_CHECKS, c.deferred.size());
+    for (int i = 0; i < checks; i++) {
+        uint32_t m = c.deferred[i];
+        if (allowed(c.members[m])) {
+            c.deferred.erase(c.deferred.begin() + i);
+            c.is_deferred[m] = false;
+            return c.members[m];
+        }
+    }
+
+    uint32_t m = 0;
+    for (int draws = 0; draws < MAX_DRAWS; draws++) {
+        if (c.pos == c.order.size()) {
+            c.order = Shuffle(c.members.size(), rng());
+            c.pos = 0;
+        }
+        m = c.order.at(c.pos++);
+        if (c.is_deferred[m]) {
+            continue;
+        }
+        if (allowed(c.members[m])) {
+            return c.members[m];
+        }
+        c.deferred.push_back(m);
+        c.is_deferred[m] = true;
+    }
+
+    // Constraints can't be satisfied right now: relax them
+    if (!c.deferred.empty()) {
+        m = c.deferred.front();
+        c.deferred.pop_front();
+        c.is_deferred[m] = false;
+    }
+    return c.members[m];
+}
+
+uint32_t Scheduler::next() {
+    // A class played every N tracks takes its turn once N others played
+    for (auto &c : classes) {
+        if (c.every > 0 && !c.members.empty() && c.since >= c.every) {
+            c.since = 0;
+            uint32_t id = pick_from(c);
+            mark_played(id);
+            return id;
+        }
+    }
+    for (auto &c : classes) {
+        if (c.every > 0) {
+            c.since++;
+        }
+    }
+
+    // Smooth weighted round robin over the other non-empty classes
+    Class *best = nullptr;
+    int64_t total = 0;
+    for (auto &c : classes) {
+        if (c.members.empty() || c.weight == 0 || c.every > 0) {
+            continue;
+        }
+        c.current += c.weight;
+        total += c.weight;
+        if (!best || c.current > best->current) {
+            best = &c;
+        }
+    }
+    if (!best) {
+        // Only zero-weight and interval classes have tracks
+        for (auto &c : classes) {
+            if (!c.members.empty()) {
+                best = &c;
+                break;
+            }
+        }
+    }
+    best->current -= total;
+
+    uint32_t id = pick_from(*best);
+    mark_played(id);
+    return id;
+}
+
+void Scheduler::played(const std::string &name) {
+    picks++;
+    history.push_back({name, "", ""});
+}
+
+SchedulerState Scheduler::save() const {
+    SchedulerState state;
+    state.picks = picks;
+    // Not rebuilt yet: hand back what is still waiting to be restored
+    state.classes = restored;
+    for (const auto &c : classes) {
+        state.classes.push_back({c.order.seed(), c.order.size(), c.pos});
+    }
+    for (const auto &p : history) {
+        state.history.push_back(p.name);
+    }
+    return state;
+}
+
+void Scheduler::restore(const SchedulerState &state) {
+    picks = state.picks;
+    restored = state.classes;
+    // Artist and album are looked up again once the library is known
+    history.clear();
+    for (const auto &name : state.history) {
+        history.push_back({name, "", ""});
+    }
+}
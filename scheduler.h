@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "library.h"
+#include "shuffle.h"
+
+// A source of tracks: a directory, or a playlist of tracks in the
+// directories
+struct RotationClass {
+    std::string dir;  // relative to the music directory, "." for itself
+    int weight = 1;
+    uint32_t every = 0;  // > 0: one track every `every` picks, not weighted
+};
+
+struct ScheduleConfig {
+    uint32_t no_repeat = 50;         // picks before a track may repeat
+    uint32_t artist_separation = 3;  // picks between tracks of one artist
+    uint32_t album_separation = 0;   // picks between tracks of one album
+    std::vector<RotationClass> rotation;
+};
+
+// Scheduler position that survives a restart: the shuffle of every
+// rotation class and the recent picks, oldest first
+struct SchedulerState {
+    struct ClassPos {
+        uint64_t seed;
+        uint32_t size;
+        uint32_t pos;
+    };
+    uint32_t picks = 0;
+    std::vector<ClassPos> classes;
+    std::vector<std::string> history;
+};
+
+// What the last rebuild left out of the schedule
+struct ScheduleStats {
+    uint32_t scheduled = 0;
+    uint32_t quarantined = 0;  // failed validation
+    // Same audio as a playable track earlier in name order
+    uint32_t duplicates = 0;
+    uint32_t mismatched = 0;   // valid, but not the mount's configuration
+    uint32_t converted = 0;    // mismatched, scheduled from a converted copy
+    // Valid tracks per AdtsFramer::key()
+    std::map<uint32_t, uint32_t> by_config;
+};
+
+// Picks the next track. Each rotation class walks its own Shuffle order and
+// the classes are interleaved by smooth weighted round robin, except for
+// classes played at a fixed interval (jingles), which cut in every N
+// picks. A drawn track that breaks the no-repeat window or artist/album
+// separation is deferred and retried on later picks, so every track is
+// examined a bounded number of times per cycle and a pick costs O(1)
+// amortized whatever the library size. When the constraints can't be met
+// (tiny classes, one artist) the longest deferred track plays anyway.
+class Scheduler {
+    struct Class {
+        int weight = 1;
+        uint32_t every = 0;
+        uint32_t since = 0;   // picks since this interval class played
+        int64_t current = 0;  // smooth weighted round robin state
+        std::vector<uint32_t> members;
+        Shuffle order;
+        uint32_t pos = 0;
+        // Deferred members, by index into `members`; a track can be in a
+        // directory class and playlist classes, deferred in each apart
+        std::deque<uint32_t> deferred;
+        std::vector<bool> is_deferred;
+    };
+
+    // Recent picks by name, to carry the constraints across rescans
+    struct Played {
+        std::string name;
+        std::string artist;
+        std::string album;
+    };
+
+    ScheduleConfig cfg;
+    const Library *library = nullptr;
+    uint32_t mount_key = 0;
+    std::function<bool(const Library &, uint32_t)> converted;
+    ScheduleStats summary;
+    std::mt19937_64 rng;
+
+    std::vector<Class> classes;
+    // Pick number + 1 of the last play, 0 for never
+    std::vector<uint32_t> track_last;
+    std::vector<uint32_t> artist_last;
+    std::vector<uint32_t> album_last;
+    uint32_t picks = 0;
+    std::deque<Played> history;
+    // Shuffle positions to continue with on the next rebuild
+    std::vector<SchedulerState::ClassPos> restored;
+
+    bool recent(uint32_t last, uint32_t window) const {
+        return last != 0 && picks + 1 - last <= window;
+    }
+    bool allowed(uint32_t id) const;
+    void mark_played(uint32_t id);
+    uint32_t pick_from(Class &c);
+
+   public:
+    explicit Scheduler(const ScheduleConfig &config);
+
+    // Adopts a freshly scanned library, keeping recent history, and the
+    // shuffle of every rotation class whose size is unchanged. Tracks that
+    // failed validation or don't match the mount's stream configuration
+    // are left out, and of files with the same audio only the first.
+    void rebuild(const Library &lib);
+
+    // Only schedules tracks whose AdtsFramer::key() is `key` (0: any).
+    // Rebuilds if a library is already set.
+    void set_mount(uint32_t key);
+
+    // Tracks of another configuration for which `fn` returns true are
+    // scheduled as well, to be played from a converted copy
+    void set_converted(std::function<bool(const Library &, uint32_t)> fn) {
+        converted = std::move(fn);
+    }
+
+    // True if no track can be scheduled
+    bool empty() const;
+
+    const ScheduleStats &stats() const { return summary; }
+
+    // Track id to play next; must not be empty()
+    uint32_t next();
+
+    // Records a track played without being picked, e.g. before the first
+    // library scan completed
+    void played(const std::string &name);
+
+    SchedulerState save() const;
+
+    // Continues from `state` at the next rebuild(). Shuffle positions are
+    // only kept if the rotation classes still have the same sizes.
+    void restore(const SchedulerState &state);
+};
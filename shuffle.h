@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+
+// Random permutation of [0, n) that needs no array: position i maps to
+// track id at(i) through a 4-round Feistel network over the smallest
+// even-width power-of-two domain >= n, cycle-walking values that land
+// outside [0, n). The domain is at most 4n, so a lookup walks fewer than
+// four times on average.
+class Shuffle {
+    uint32_t n = 0;
+    uint64_t seed_ = 0;
+    int half_bits = 1;
+    uint32_t half_mask = 1;
+    uint64_t keys[4] = {};
+
+    static uint32_t mix(uint32_t x, uint64_t key) {
+        uint64_t z = x + key;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t permute(uint32_t x) const {
+        uint32_t left = x >> half_bits;
+        uint32_t right = x & half_mask;
+        for (uint64_t key : keys) {
+            uint32_t next = left ^ (mix(right, key) & half_mask);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits) | right;
+    }
+
+   public:
+    Shuffle() = default;
+
+    Shuffle(uint32_t size, uint64_t seed) : n(size), seed_(seed) {
+        while ((uint64_t)1 << (2 * half_bits) < n) {
+            half_bits++;
+        }
+        half_mask = ((uint32_t)1 << half_bits) - 1;
+        std::mt19937_64 g(seed);
+        for (auto &key : keys) {
+            key = g();
+        }
+    }
+
+    uint32_t size() const { return n; }
+    uint64_t seed() const { return seed_; }
+
+    // Track id at position `i` (< size()) of this cycle's order
+    uint32_t at(uint32_t i) const {
+        uint32_t x = i;
+        do {
+            x = permute(x);
+        } while (x >= n);
+        return x;
+    }
+};
@@ -0,0 +1,192 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "realtime.h"
+
+namespace {
+
+// The pool and queue a worker thread serves, so submit() can tell its own
+// workers apart
+thread_local const void *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t threads, bool idle) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker, this, idle);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        tasks.clear();
+    }
+    work_cv.notify_all();
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    work_cv.notify_one();
+}
+
+void ThreadPool::worker(bool idle) {
+    if (idle) {
+        make_thread_idle();
+    } else {
+        make_thread_background();
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (stopping) {
+            return;
+        }
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        try {
+            task();
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+        }
+        lock.lock();
+    }
+}
+
+void TaskGroup::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+    pool.submit([this, task = std::move(task)] {
+        // Counted off even if the task throws
+        struct Done {
+            TaskGroup *group;
+            ~Done() {
+                std::lock_guard<std::mutex> lock(group->mutex);
+                if (--group->pending == 0) {
+                    group->cv.notify_all();
+                }
+            }
+        } done{this};
+        task();
+    });
+}
+
+void TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return pending == 0; });
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads, const RealtimeConfig &rt) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    // Only the priority carries over: workers float over all cores, and
+    // memory locking is process-wide anyway
+    RealtimeConfig worker_rt;
+    worker_rt.priority = rt.priority;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&WorkStealingPool::worker, this, i, worker_rt);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    sleep_cv.notify_all();
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    size_t q = current_pool == this
+                   ? current_queue
+                   : next_queue.fetch_add(1, std::memory_order_relaxed) %
+                         queues.size();
+    // Counted first, so the count never drops below the queued tasks
+    queued.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        queues[q]->tasks.push_back(std::move(task));
+    }
+    // Paired with the check in worker(): either the sleeper sees the task
+    // or this sees the sleeper
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        sleep_cv.notify_one();
+    }
+}
+
+bool WorkStealingPool::take(size_t self, std::function<void()> &task) {
+    // Own queue from the back (newest, still in cache), others from the
+    // front
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue &q = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::worker(size_t self, RealtimeConfig rt) {
+    current_pool = this;
+    current_queue = self;
+    if (rt.priority > 0) {
+        try {
+            make_thread_realtime(rt);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+        }
+    }
+    std::function<void()> task;
+    while (true) {
+        if (take(self, task)) {
+            try {
+                task();
+            } catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << "\n";
+            }
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1);
+        sleep_cv.wait(lock, [this] { return stopping || queued.load() > 0; });
+        sleeping.fetch_sub(1);
+        if (stopping) {
+            return;
+        }
+    }
+}
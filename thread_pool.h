@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "realtime.h"
+
+// Fixed set of low-priority workers for batch jobs (probing, analysis).
+// Workers run at idle scheduling priority so they only use CPU time the
+// pacing thread and the rest of the host leave over; or, for blocking I/O
+// that something waits for, at background priority.
+class ThreadPool {
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void worker(bool idle);
+
+   public:
+    // 0 threads: one per core
+    explicit ThreadPool(size_t threads = 0, bool idle = true);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task);
+};
+
+// Tasks of one caller on a ThreadPool, which may be shared: wait() only
+// waits for these, however busy others keep the pool
+class TaskGroup {
+    ThreadPool &pool;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t pending = 0;
+
+   public:
+    explicit TaskGroup(ThreadPool &p) : pool(p) {}
+    // Waits, as the tasks may refer to the caller's locals
+    ~TaskGroup() { wait(); }
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every task submitted here has finished
+    void wait();
+};
+
+// Workers for latency-bound work (the sends of many channels). Each worker
+// has its own queue; tasks submitted from a worker stay on its queue,
+// others are spread round robin, and a worker that runs dry steals from
+// the others, so a burst of due work spreads over all cores without every
+// submit contending on one lock. Workers run at the pacing thread's
+// priority.
+class WorkStealingPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> sleeping{0};
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    bool take(size_t self, std::function<void()> &task);
+    void worker(size_t self, RealtimeConfig rt);
+
+   public:
+    // 0 threads: one per core. Workers get the SCHED_FIFO priority of
+    // `rt`, if any.
+    explicit WorkStealingPool(size_t threads = 0,
+                              const RealtimeConfig &rt = {});
+    // Running tasks finish, queued ones are dropped
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task);
+};
@@ -0,0 +1,64 @@
+#include "track_reader.h"
+
+#include <stdexcept>
+
+TrackReader::TrackReader(InputFile &in)
+    : input(in),
+      window(track_window(in.ctx, in.stream())),
+      preroll(av_packet_alloc()),
+      held(av_packet_alloc()) {
+    if (!preroll || !held) {
+        av_packet_free(&preroll);
+        av_packet_free(&held);
+        throw std::runtime_error("Out of memory");
+    }
+}
+
+TrackReader::~TrackReader() {
+    av_packet_free(&preroll);
+    av_packet_free(&held);
+}
+
+void TrackReader::start_at(int64_t pts) {
+    if (pts <= window.begin) {
+        return;
+    }
+    window.begin = pts;
+    if (av_seek_frame(input.ctx, input.stream_index, pts,
+                      AVSEEK_FLAG_BACKWARD) < 0) {
+        throw std::runtime_error("Seek failed");
+    }
+}
+
+bool TrackReader::next(AVPacket *pkt) {
+    if (have_held) {
+        av_packet_move_ref(pkt, held);
+        have_held = false;
+        return true;
+    }
+    while (av_read_frame(input.ctx, pkt) >= 0) {
+        if (pkt->stream_index != input.stream_index ||
+            window.is_padding(pkt)) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (window.is_priming(pkt)) {
+            if (use_preroll) {
+                av_packet_unref(preroll);
+                av_packet_move_ref(preroll, pkt);
+                have_preroll = true;
+            } else {
+                av_packet_unref(pkt);
+            }
+            continue;
+        }
+        if (have_preroll) {
+            av_packet_move_ref(held, pkt);
+            have_held = true;
+            av_packet_move_ref(pkt, preroll);
+            have_preroll = false;
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "input_file.h"
+#include "probe.h"
+
+// Reads the packets of a track that go on air, for every passthrough path
+// (the main mount, renditions, channels): the audio stream's packets inside
+// the gapless window, with encoder delay and padding dropped a whole frame
+// at a time. The last priming packet is held back and returned just ahead
+// of the first real one, so the listener's decoder has the overlap it needs
+// for the first real samples.
+class TrackReader {
+    InputFile &input;
+    GaplessWindow window;
+    bool use_preroll = true;
+    AVPacket *preroll = nullptr;
+    bool have_preroll = false;
+    AVPacket *held = nullptr;  // the first real packet, behind the preroll
+    bool have_held = false;
+
+   public:
+    // Reads `input` within the window placed by its sample table
+    explicit TrackReader(InputFile &input);
+    ~TrackReader();
+
+    TrackReader(const TrackReader &) = delete;
+    TrackReader &operator=(const TrackReader &) = delete;
+
+    const GaplessWindow &gapless() const { return window; }
+
+    // Starts at `pts` rather than the beginning of the audio, seeking
+    // through the demuxer's sample table index; nothing is read before
+    // it. Throws std::runtime_error.
+    void start_at(int64_t pts);
+
+    // Drops the priming packets instead, for a start that the previous
+    // track already faded into
+    void drop_preroll() { use_preroll = false; }
+
+    // Moves the next packet to send into `pkt`; false at the end of the
+    // track
+    bool next(AVPacket *pkt);
+};
@@ -0,0 +1,465 @@
+#include "transcoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include "adts.h"
+#include "realtime.h"
+
+namespace {
+
+// Encoder bitrate per channel until the mount's is known
+const int64_t BITRATE_PER_CHANNEL = 64000;
+
+// FNV-1a of the whole file
+uint64_t content_hash(const fs::path &path) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is) {
+        throw std::runtime_error("Could not read file");
+    }
+    uint64_t h = 14695981039346656037ULL;
+    std::vector<char> buf(1 << 20);
+    while (is.read(buf.data(), buf.size()) || is.gcount() > 0) {
+        for (std::streamsize i = 0; i < is.gcount(); i++) {
+            h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// Everything one conversion holds, released in any case
+struct Pipeline {
+    AVFormatContext *in = nullptr;
+    AVFormatContext *out = nullptr;
+    AVCodecContext *dec = nullptr;
+    AVCodecContext *enc = nullptr;
+    SwrContext *swr = nullptr;
+    AVAudioFifo *fifo = nullptr;
+    AVFrame *decoded = nullptr;
+    AVFrame *resampled = nullptr;
+    AVFrame *frame = nullptr;
+    AVPacket *pkt = nullptr;
+    int64_t next_pts = 0;
+    float gain = 1.0f;  // linear, applied after resampling
+
+    ~Pipeline() {
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+        av_frame_free(&resampled);
+        av_frame_free(&decoded);
+        if (fifo) {
+            av_audio_fifo_free(fifo);
+        }
+        swr_free(&swr);
+        avcodec_free_context(&enc);
+        avcodec_free_context(&dec);
+        if (out) {
+            if (!(out->oformat->flags & AVFMT_NOFILE)) {
+                avio_closep(&out->pb);
+            }
+            avformat_free_context(out);
+        }
+        avformat_close_input(&in);
+    }
+
+    // Encodes and muxes `f` (nullptr flushes the encoder)
+    void encode(AVFrame *f) {
+        if (avcodec_send_frame(enc, f) < 0) {
+            throw std::runtime_error("Encoding failed");
+        }
+        while (avcodec_receive_packet(enc, pkt) == 0) {
+            pkt->stream_index = 0;
+            av_packet_rescale_ts(pkt, enc->time_base,
+                                 out->streams[0]->time_base);
+            if (av_interleaved_write_frame(out, pkt) < 0) {
+                throw std::runtime_error("Could not write converted file");
+            }
+        }
+    }
+
+    // Encodes whole encoder frames from the FIFO; with `flush` the last
+    // partial frame too
+    void drain_fifo(bool flush) {
+        while (av_audio_fifo_size(fifo) >= enc->frame_size ||
+               (flush && av_audio_fifo_size(fifo) > 0)) {
+            av_frame_unref(frame);
+            frame->nb_samples =
+                std::min(av_audio_fifo_size(fifo), enc->frame_size);
+            frame->format = enc->sample_fmt;
+            frame->sample_rate = enc->sample_rate;
+            av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout);
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                throw std::runtime_error("Out of memory");
+            }
+            av_audio_fifo_read(fifo, (void **)frame->data, frame->nb_samples);
+            frame->pts = next_pts;
+            next_pts += frame->nb_samples;
+            encode(frame);
+        }
+    }
+
+    // Resamples `f` (nullptr flushes the resampler) into the FIFO
+    void resample(const AVFrame *f) {
+        av_frame_unref(resampled);
+        resampled->format = enc->sample_fmt;
+        resampled->sample_rate = enc->sample_rate;
+        av_channel_layout_copy(&resampled->ch_layout, &enc->ch_layout);
+        if (swr_convert_frame(swr, resampled, f) < 0) {
+            throw std::runtime_error("Resampling failed");
+        }
+        if (gain != 1.0f) {
+            for (int c = 0; c < enc->ch_layout.nb_channels; c++) {
+                float *s = (float *)resampled->data[c];
+                for (int i = 0; i < resampled->nb_samples; i++) {
+                    s[i] *= gain;
+                }
+            }
+        }
+        if (resampled->nb_samples > 0 &&
+            av_audio_fifo_write(fifo, (void **)resampled->data,
+                                resampled->nb_samples) < 0) {
+            throw std::runtime_error("Out of memory");
+        }
+    }
+
+    void decode(const AVPacket *p) {
+        if (avcodec_send_packet(dec, p) < 0) {
+            // A damaged packet is skipped, as a player would
+            return;
+        }
+        while (avcodec_receive_frame(dec, decoded) == 0) {
+            resample(decoded);
+            av_frame_unref(decoded);
+            drain_fifo(false);
+        }
+    }
+};
+
+}  // namespace
+
+AVCodecContext *open_aac_encoder(uint32_t key, bool global_header,
+                                 int64_t bit_rate) {
+    int object_type = key >> 16;
+    int sample_rate = AdtsFramer::sample_rate_of((key >> 8) & 0xFF);
+    int channels = key & 0xFF;
+    if (object_type < 1 || sample_rate == 0 || channels < 1) {
+        throw std::runtime_error("No target configuration");
+    }
+    const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    AVCodecContext *enc = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+    if (!enc) {
+        throw std::runtime_error("No AAC encoder");
+    }
+    enc->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    enc->sample_rate = sample_rate;
+    av_channel_layout_default(&enc->ch_layout, channels);
+    enc->bit_rate = bit_rate > 0 ? bit_rate : BITRATE_PER_CHANNEL * channels;
+    enc->profile = object_type - 1;  // FF_PROFILE_AAC_MAIN + aot - 1
+    enc->time_base = {1, sample_rate};
+    if (global_header) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(enc, encoder, nullptr) < 0) {
+        avcodec_free_context(&enc);
+        throw std::runtime_error("Could not open AAC encoder for " +
+                                 AdtsFramer::describe(key));
+    }
+    return enc;
+}
+
+Transcoder::Transcoder(const fs::path &d, size_t threads, int b)
+    : dir(d), budget(std::clamp(b, 1, 100)), pool(threads) {
+    surveyor = std::thread(&Transcoder::survey_loop, this);
+}
+
+Transcoder::~Transcoder() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    survey_cv.notify_all();
+    surveyor.join();
+}
+
+void Transcoder::submit(std::function<void()> job) {
+    pool.submit([this, job] {
+        auto start = std::chrono::steady_clock::now();
+        job();
+        if (budget < 100) {
+            auto rest = (std::chrono::steady_clock::now() - start) *
+                        (100 - budget) / budget;
+            std::unique_lock<std::mutex> lock(mutex);
+            stop_cv.wait_for(lock, rest, [this] { return stopping.load(); });
+        }
+    });
+}
+
+fs::path Transcoder::output_path(const std::string &name, int64_t size,
+                                 int64_t mtime) const {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : name) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    char file[96];
+    snprintf(file, sizeof(file), "%016llx-%06x-%llx-%llx.m4a",
+             (unsigned long long)h, (unsigned)target_key(),
+             (unsigned long long)size, (unsigned long long)mtime);
+    return dir / file;
+}
+
+void Transcoder::request(const std::string &name, const fs::path &source,
+                         const fs::path &output) {
+    // Outputs stay in `pending` once done, so a file that fails isn't
+    // retried on every rescan
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending.insert(output.string()).second) {
+            return;
+        }
+    }
+    uint32_t key = target_key();
+    int64_t bit_rate = bitrate;
+    submit([this, name, source, output, key, bit_rate] {
+        fs::path tmp = output;
+        tmp += ".tmp";
+        try {
+            convert(source, tmp, key, 1.0f, bit_rate);
+            fs::rename(tmp, output);
+            std::cout << "Converted " << source.filename() << " to "
+                      << AdtsFramer::describe(key) << "\n";
+        } catch (const std::exception &e) {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            if (!stopping) {
+                std::cerr << "Error: converting " << source << ": "
+                          << e.what() << "\n";
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done.insert(output.string());
+        mark_done(name, output);
+    });
+}
+
+void Transcoder::mark_done(const std::string &name, const fs::path &output) {
+    std::shared_ptr<const Copies> last = std::atomic_load(&surveyed);
+    if (!last) {
+        return;
+    }
+    // The copy may have been asked for by an earlier library
+    const Library &lib = *last->library;
+    uint32_t id = lib.find(name);
+    if (id == Library::NOT_FOUND || last->on_disk[id] ||
+        output_path(name, lib.file_size(id), lib.mtime(id)) != output) {
+        return;
+    }
+    auto next = std::make_shared<Copies>(*last);
+    next->on_disk[id] = true;
+    std::atomic_store(&surveyed, std::shared_ptr<const Copies>(next));
+}
+
+void Transcoder::survey(std::shared_ptr<const Library> lib) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        to_survey = std::move(lib);
+    }
+    survey_cv.notify_one();
+}
+
+void Transcoder::survey_loop() {
+    make_thread_idle();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        survey_cv.wait(lock, [this] { return stopping || to_survey; });
+        if (stopping) {
+            return;
+        }
+        std::shared_ptr<const Library> lib = std::move(to_survey);
+        to_survey.reset();
+        lock.unlock();
+
+        auto result = std::make_shared<Copies>();
+        result->library = lib;
+        result->on_disk.resize(lib->size());
+        std::vector<std::pair<uint32_t, std::string>> missing;
+        uint32_t key = target_key();
+        for (uint32_t id = 0; id < lib->size() && !stopping; id++) {
+            if (lib->status(id) != TrackStatus::OK ||
+                lib->adts_key(id) == key) {
+                continue;
+            }
+            fs::path out =
+                output_path(lib->name(id), lib->file_size(id), lib->mtime(id));
+            std::error_code ec;
+            if (fs::exists(out, ec)) {
+                result->on_disk[id] = true;
+            } else {
+                request(lib->name(id), lib->path(id), out);
+                missing.emplace_back(id, out.string());
+            }
+        }
+
+        lock.lock();
+        // Conversions that finished while the disk was being looked at
+        for (const auto &m : missing) {
+            if (done.count(m.second)) {
+                result->on_disk[m.first] = true;
+            }
+        }
+        std::atomic_store(&surveyed, std::shared_ptr<const Copies>(result));
+    }
+}
+
+void Transcoder::normalize(const std::string &request_key,
+                           const fs::path &source, float gain_db) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending.insert(request_key).second) {
+            return;
+        }
+    }
+    uint32_t key = target_key();
+    int64_t bit_rate = bitrate;
+    submit([this, request_key, source, gain_db, key, bit_rate] {
+        fs::path output, tmp;
+        try {
+            char file[96];
+            snprintf(file, sizeof(file), "%016llx-%06x-%+ld.m4a",
+                     (unsigned long long)content_hash(source), (unsigned)key,
+                     std::lround(gain_db * 10));
+            output = dir / "normalized" / file;
+            if (!fs::exists(output)) {
+                tmp = output;
+                tmp += ".tmp";
+                convert(source, tmp, key, std::pow(10.0f, gain_db / 20),
+                        bit_rate);
+                fs::rename(tmp, output);
+                std::cout << "Normalized " << source.filename() << " by "
+                          << gain_db << " dB\n";
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            normalized[request_key] = output;
+        } catch (const std::exception &e) {
+            std::error_code ec;
+            if (!tmp.empty()) {
+                fs::remove(tmp, ec);
+            }
+            if (!stopping) {
+                std::cerr << "Error: normalizing " << source << ": "
+                          << e.what() << "\n";
+            }
+        }
+    });
+}
+
+fs::path Transcoder::normalized_path(const std::string &key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = normalized.find(key);
+    return it == normalized.end() ? fs::path() : it->second;
+}
+
+void Transcoder::convert(const fs::path &source, const fs::path &output,
+                         uint32_t key, float gain, int64_t bit_rate) {
+    std::error_code ec;
+    fs::create_directories(output.parent_path(), ec);
+
+    Pipeline p;
+    p.gain = gain;
+    if (avformat_open_input(&p.in, source.c_str(), nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(p.in, nullptr) < 0) {
+        throw std::runtime_error("Could not open input file");
+    }
+    const AVCodec *decoder = nullptr;
+    int stream_index = av_find_best_stream(p.in, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                           &decoder, 0);
+    if (stream_index < 0 || !decoder) {
+        throw std::runtime_error("No decodable audio stream");
+    }
+    p.dec = avcodec_alloc_context3(decoder);
+    if (!p.dec ||
+        avcodec_parameters_to_context(
+            p.dec, p.in->streams[stream_index]->codecpar) < 0 ||
+        avcodec_open2(p.dec, decoder, nullptr) < 0) {
+        throw std::runtime_error("Could not open decoder");
+    }
+
+    if (avformat_alloc_output_context2(&p.out, nullptr, "ipod",
+                                       output.c_str()) < 0) {
+        throw std::runtime_error("Could not create output");
+    }
+    p.enc = open_aac_encoder(key, p.out->oformat->flags & AVFMT_GLOBALHEADER,
+                             bit_rate);
+
+    AVStream *st = avformat_new_stream(p.out, nullptr);
+    if (!st || avcodec_parameters_from_context(st->codecpar, p.enc) < 0) {
+        throw std::runtime_error("Could not create output stream");
+    }
+    st->time_base = p.enc->time_base;
+    // Keep the tags for the library index and stream titles
+    av_dict_copy(&p.out->metadata, p.in->metadata, 0);
+    if (avio_open(&p.out->pb, output.c_str(), AVIO_FLAG_WRITE) < 0 ||
+        avformat_write_header(p.out, nullptr) < 0) {
+        throw std::runtime_error("Could not write " + output.string());
+    }
+
+    if (swr_alloc_set_opts2(&p.swr, &p.enc->ch_layout, p.enc->sample_fmt,
+                            p.enc->sample_rate, &p.dec->ch_layout,
+                            p.dec->sample_fmt, p.dec->sample_rate, 0,
+                            nullptr) < 0 ||
+        swr_init(p.swr) < 0) {
+        throw std::runtime_error("Could not set up resampler");
+    }
+    p.fifo = av_audio_fifo_alloc(p.enc->sample_fmt,
+                                 p.enc->ch_layout.nb_channels,
+                                 p.enc->frame_size);
+    p.decoded = av_frame_alloc();
+    p.resampled = av_frame_alloc();
+    p.frame = av_frame_alloc();
+    p.pkt = av_packet_alloc();
+    AVPacket *in_pkt = av_packet_alloc();
+    if (!p.fifo || !p.decoded || !p.resampled || !p.frame || !p.pkt ||
+        !in_pkt) {
+        av_packet_free(&in_pkt);
+        throw std::runtime_error("Out of memory");
+    }
+
+    try {
+        while (!stopping && av_read_frame(p.in, in_pkt) >= 0) {
+            if (in_pkt->stream_index == stream_index) {
+                p.decode(in_pkt);
+            }
+            av_packet_unref(in_pkt);
+        }
+    } catch (...) {
+        av_packet_free(&in_pkt);
+        throw;
+    }
+    av_packet_free(&in_pkt);
+    if (stopping) {
+        throw std::runtime_error("Stopped");
+    }
+
+    p.decode(nullptr);
+    p.resample(nullptr);
+    p.drain_fifo(true);
+    p.encode(nullptr);
+    if (av_write_trailer(p.out) < 0) {
+        throw std::runtime_error("Could not finish " + output.string());
+    }
+}
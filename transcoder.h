@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "library.h"
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+struct AVCodecContext;
+
+// Opens FFmpeg's AAC encoder for the configuration `key` (AdtsFramer::key())
+// taking planar float input, at `bit_rate` bits per second or a default
+// for the channel count if 0. Throws std::runtime_error.
+AVCodecContext *open_aac_encoder(uint32_t key, bool global_header,
+                                 int64_t bit_rate = 0);
+
+// Converts tracks whose AAC configuration doesn't match the mount into
+// matching .m4a copies in a cache directory (decode, resample with
+// libswresample, AAC encode), and tracks far from the target loudness into
+// gain-adjusted ones. Conversion runs ahead of time on a few idle-priority
+// workers; once a copy exists the track streams from it through the normal
+// passthrough path, so every file is converted once.
+class Transcoder {
+   public:
+    // Which tracks of `library` have their converted copy on disk, by id
+    struct Copies {
+        std::shared_ptr<const Library> library;
+        std::vector<bool> on_disk;
+    };
+
+   private:
+    fs::path dir;
+    int budget;
+    std::atomic<uint32_t> target{0};
+    std::atomic<int64_t> bitrate{0};
+    std::atomic<bool> stopping{false};
+
+    mutable std::mutex mutex;
+    std::condition_variable stop_cv;
+    std::unordered_set<std::string> pending;  // outputs requested so far
+    std::unordered_set<std::string> done;     // of those, the ones on disk
+    // Normalized copies on disk, by request key
+    std::unordered_map<std::string, fs::path> normalized;
+
+    // Latest library handed to survey(), and the result of the last survey
+    // kept up to date as copies land (read with std::atomic_load)
+    std::shared_ptr<const Library> to_survey;
+    std::shared_ptr<const Copies> surveyed;
+    std::condition_variable survey_cv;
+
+    ThreadPool pool;
+    std::thread surveyor;
+
+    // Runs `job` on the pool, then rests so converting stays within the
+    // budget
+    void submit(std::function<void()> job);
+    void convert(const fs::path &source, const fs::path &output,
+                 uint32_t key, float gain, int64_t bit_rate);
+    // Converts track `name` from `source` to `output` in the background
+    // unless that is done or already queued
+    void request(const std::string &name, const fs::path &source,
+                 const fs::path &output);
+    // Sets the bit of `output` in the survey, under `mutex`
+    void mark_done(const std::string &name, const fs::path &output);
+    void survey_loop();
+
+   public:
+    // `threads` and `budget`, the percentage of each thread's time spent
+    // converting, bound the CPU time and disk bandwidth used
+    Transcoder(const fs::path &dir, size_t threads, int budget = 100);
+    ~Transcoder();
+
+    // Configuration to convert to, as AdtsFramer::key()
+    void set_target(uint32_t key) { target = key; }
+    uint32_t target_key() const { return target; }
+
+    // Bitrate of the mount, which copies are encoded at; 0 until known
+    // picks one for the channel count
+    void set_bitrate(int64_t bit_rate) { bitrate = bit_rate; }
+
+    // Where the converted copy of the file `name` (relative to the music
+    // directory) lives for the current target
+    fs::path output_path(const std::string &name, int64_t size,
+                         int64_t mtime) const;
+
+    // Looks for the copies of `lib`'s tracks that don't match the target
+    // on a thread of its own, and queues conversion of the missing ones.
+    // Only the latest library is surveyed if several are waiting.
+    void survey(std::shared_ptr<const Library> lib);
+
+    // The last survey, updated as copies land; nullptr before the first.
+    // A new pointer means tracks may have joined: the pacing thread looks
+    // bits up here rather than checking the disk itself.
+    std::shared_ptr<const Copies> copies() const {
+        return std::atomic_load(&surveyed);
+    }
+
+    // Converts `source` with `gain_db` applied in the background. The copy
+    // is named after a hash of the file's contents and the gain, so it is
+    // found again after a restart or a rename; `key` identifies the request
+    // for normalized_path().
+    void normalize(const std::string &key, const fs::path &source,
+                   float gain_db);
+
+    // The copy normalize() made for `key`, empty until it is on disk
+    fs::path normalized_path(const std::string &key) const;
+};